@@ -0,0 +1,169 @@
+/* Name: testrollup.c
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+/*
+General Description:
+Checks the rollups of the daemon: rollupAdd() as the writer and
+"tinysct rollup" as the reader. The tool is built into this program without
+libusb (see the hidraw target in the Makefile), so it runs without a device.
+Each case writes its readings into a new rollup file with rollupAdd(), runs
+queries on the minute, hour and day tiers and compares the lines printed
+with the expected ones: start, count, mean, lowest, highest and standard
+deviation. The cases cover a daemon stopped for shorter than, exactly and
+longer than one lap of a ring, whose old buckets must neither be printed nor
+merged into a period of the current lap.
+*/
+
+#define main    tinysctMain
+#include "tinysct.c"
+#undef main
+
+#define MINUTE  60
+#define HOUR    3600
+#define DAY     86400
+
+typedef struct testReading{
+    long        seconds;    /* time of the reading, -1 ends the list */
+    double      value;
+}testReading_t;
+
+typedef struct testQuery{
+    const char  *resolution;    /* argument of the rollup command, seconds, NULL ends the list */
+    const char  *expect[8];     /* lines printed, NULL ends the list */
+}testQuery_t;
+
+typedef struct testCase{
+    const char      *name;
+    uint32_t        slots[ROLLUP_TIERS];    /* -R */
+    testReading_t   readings[16];
+    testQuery_t     queries[5];     /* NULL resolution ends the list */
+}testCase_t;
+
+static const testCase_t testCases[] = {
+    {"accumulation", {4, 3, 2},
+        {{0, 1}, {20, 3}, {40, 5}, {70, 10}, {-1}},
+        {{"60", {"0 3 3.00 1.00 5.00 1.63", "60 1 10.00 10.00 10.00 0.00"}},
+         {"120", {"0 4 4.75 1.00 10.00 3.34"}},
+         {"3600", {"0 4 4.75 1.00 10.00 3.34"}},
+         {"86400", {"0 4 4.75 1.00 10.00 3.34"}}}},
+    {"minutes, gap shorter than a lap", {6, 0, 0},
+        {{0, 0}, {MINUTE, 1}, {2 * MINUTE, 2}, {3 * MINUTE, 3}, {7 * MINUTE, 7}, {8 * MINUTE, 8}, {-1}},
+        {{"60", {"180 1 3.00 3.00 3.00 0.00", "420 1 7.00 7.00 7.00 0.00", "480 1 8.00 8.00 8.00 0.00"}}}},
+    {"minutes, gap of exactly a lap", {6, 0, 0},
+        {{0, 0}, {MINUTE, 1}, {2 * MINUTE, 2}, {8 * MINUTE, 8}, {-1}},
+        {{"60", {"480 1 8.00 8.00 8.00 0.00"}}}},
+    {"minutes, gap longer than a lap", {4, 3, 2},
+        {{0, 0}, {MINUTE, 1}, {2 * MINUTE, 2}, {3 * MINUTE, 3}, {4 * MINUTE, 4}, {5 * MINUTE, 5},
+         {13 * MINUTE, 13}, {14 * MINUTE, 14}, {-1}},
+        {{"60", {"780 1 13.00 13.00 13.00 0.00", "840 1 14.00 14.00 14.00 0.00"}},
+         {"3600", {"0 8 5.25 0.00 14.00 4.99"}},
+         {"86400", {"0 8 5.25 0.00 14.00 4.99"}}}},
+    {"minutes merged, gap longer than a lap", {6, 0, 0},
+        {{0, 0}, {MINUTE, 1}, {2 * MINUTE, 2}, {3 * MINUTE, 3}, {4 * MINUTE, 4}, {5 * MINUTE, 5},
+         {16 * MINUTE, 16}, {19 * MINUTE, 19}, {20 * MINUTE, 20}, {-1}},
+        {{"180", {"900 1 16.00 16.00 16.00 0.00", "1080 2 19.50 19.00 20.00 0.50"}}}},
+    {"hours, gap longer than a lap", {4, 3, 2},
+        {{0, 0}, {HOUR, 1}, {2 * HOUR, 2}, {3 * HOUR, 3}, {7 * HOUR, 7}, {-1}},
+        {{"60", {"25200 1 7.00 7.00 7.00 0.00"}},
+         {"3600", {"25200 1 7.00 7.00 7.00 0.00"}},
+         {"86400", {"0 5 2.60 0.00 7.00 2.42"}}}},
+    {"days, gap longer than a lap", {4, 3, 2},
+        {{0, 0}, {DAY, 1}, {5 * DAY, 5}, {-1}},
+        {{"3600", {"432000 1 5.00 5.00 5.00 0.00"}},
+         {"86400", {"432000 1 5.00 5.00 5.00 0.00"}}}},
+};
+
+/* Write the readings of c with rollupAdd(), as the daemon does. */
+static int  testFill(const char *fileName, const testCase_t *c)
+{
+rollup_t    r;
+int         i;
+
+    unlink(fileName);
+    if(rollupMap(&r, (char *)fileName, c->slots) != 0)
+        return 1;
+    for(i = 0; c->readings[i].seconds >= 0; i++)
+        rollupAdd(&r, (int64_t)c->readings[i].seconds * 1000, c->readings[i].value);
+    munmap(r.header, r.size);
+    return 0;
+}
+
+/* Run query q of c with its output in outName and compare the lines. */
+static int  testQuery(const char *fileName, const char *outName, const testCase_t *c, const testQuery_t *q)
+{
+char        *argv[] = {"tinysct", "rollup", (char *)fileName, (char *)q->resolution, NULL};
+char        line[256];
+FILE        *in;
+int         i = 0, errors = 0, fd, null, savedOut, savedErr;
+
+    if((fd = open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || (null = open("/dev/null", O_WRONLY)) < 0){
+        perror(outName);
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    savedOut = dup(1);
+    savedErr = dup(2);
+    dup2(fd, 1);
+    dup2(null, 2);  /* the tier used */
+    rollupMain(4, argv);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(savedOut, 1);
+    dup2(savedErr, 2);
+    close(savedOut);
+    close(savedErr);
+    close(fd);
+    close(null);
+    if((in = fopen(outName, "r")) == NULL){
+        perror(outName);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), in) != NULL){
+        line[strcspn(line, "\n")] = 0;
+        if(q->expect[i] == NULL){
+            fprintf(stderr, "%s, resolution %s: extra line \"%s\"\n", c->name, q->resolution, line);
+            errors++;
+            continue;
+        }
+        if(strcmp(line, q->expect[i]) != 0){
+            fprintf(stderr, "%s, resolution %s: line %d is \"%s\", expected \"%s\"\n", c->name, q->resolution, i + 1, line, q->expect[i]);
+            errors++;
+        }
+        i++;
+    }
+    fclose(in);
+    if(q->expect[i] != NULL){
+        fprintf(stderr, "%s, resolution %s: %d lines, expected more\n", c->name, q->resolution, i);
+        errors++;
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+char    fileName[] = "/tmp/testrollupXXXXXX", outName[64];
+int     i, j, fd, errors = 0;
+
+    if((fd = mkstemp(fileName)) < 0){
+        perror(fileName);
+        return 1;
+    }
+    close(fd);
+    snprintf(outName, sizeof(outName), "%s.out", fileName);
+    for(i = 0; i < (int)(sizeof(testCases) / sizeof(testCases[0])); i++){
+        if(testFill(fileName, &testCases[i]) != 0)
+            return 1;
+        for(j = 0; testCases[i].queries[j].resolution != NULL; j++)
+            errors += testQuery(fileName, outName, &testCases[i], &testCases[i].queries[j]);
+    }
+    unlink(fileName);
+    unlink(outName);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -9,15 +9,44 @@
 /*
 General Description:
 This program controls the tinysct USB device from the command line.
-It must be linked with libusb, a library for accessing the USB bus from
-Linux, FreeBSD, Mac OS X and other Unix operating systems. Libusb can be
-obtained from http://libusb.sourceforge.net/.
+It must be linked with libusb-1.0, a library for accessing the USB bus from
+Linux, FreeBSD, Mac OS X, Windows and other operating systems. Libusb can be
+obtained from https://libusb.info/. Commands that talk to several devices
+use its asynchronous API, so the requests to all devices are in flight at
+the same time.
+On Linux the measurement commands can also use the device's hidraw node
+(/dev/hidrawN), which needs neither libusb nor root privileges. Compile with
+-DNO_LIBUSB to build a tool that only supports hidraw.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <usb.h>    /* this is libusb, see http://libusb.sourceforge.net/ */
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifndef NO_LIBUSB
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifndef NO_LIBUSB
+#include <libusb.h> /* this is libusb-1.0, see https://libusb.info/ */
+#endif
+#include "tinysctshm.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#define HAVE_HIDRAW
+#endif
 
 #define USBDEV_SHARED_VENDOR    0x6666  /* Prototype product Vendor ID */
 #define USBDEV_SHARED_PRODUCT   0x0004  /* Prototype product Product ID */
@@ -28,130 +57,2080 @@ obtained from http://libusb.sourceforge.net/.
 #define CLICMD_GETADC 7
 #define CLICMD_GETACC 8
 #define CLICMD_GETCNT 9
+#define CLICMD_GETRST 10
+#define CLICMD_GETNRG 11
+#define CLICMD_GETPERF 12
+#define CLICMD_MEASURE 13
+#define CLICMD_GETRMS 14
+#define CLICMD_GETCAP 15
+#define CLICMD_GETHIST 16
+#define CLICMD_GETCFG 17
+#define CLICMD_SETCFG 18
+#define CLICMD_LOGINFO 19
+#define CLICMD_GETLOG 20
+#define CLICMD_GETCYCLE 21
+#define CLICMD_SETSERIAL 22
+
+#define CONFIG_CONTINUOUS   0x01    /* flags of CLICMD_SETCFG */
+#define CONFIG_GAIN20       0x02
+
+#define PERF_TICK_US  (64 / 16.5)   /* Timer0 tick of the firmware in microseconds */
+#define INTERVAL_TICK_MS (16384 / 16500.0)  /* Timer1 tick of the firmware in milliseconds */
 
 /* These are the vendor specific SETUP commands implemented by our USB device */
 
-static void usage(char *name)
+#define HIDCMD_RUNADC 1     /* first byte of a feature report written to the device */
+#define HIST_BINS     16    /* histogram bins, see firmware/measure.h */
+#define RECORD_SIZE   8     /* measurement record in the HID input and feature reports */
+
+#define HID_GET_REPORT      1
+#define HID_REPORT_FEATURE  3
+
+#define INTERVAL_MS             200 /* duration of a measurement */
+#define MAX_DEVICES             16
+#define RUNALL_MARGIN_MS        5   /* time to start the first request */
+#define DAEMON_RETRY_MS         1000    /* time between attempts to reopen the device */
+#define DAEMON_FAST_RETRY_MS    10      /* the same after the device arrived */
+#define DAEMON_FAST_RETRIES     50
+#define DAEMON_FLUSH_MS         1000    /* longest time a record stays in the output buffer */
+#define EXPORTER_BACKOFF_MS     100     /* wait after a failed accept() */
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [-p bus-port[.port...]] [-s serial] [-c cache_file] [-m shm_file] [-e [host:]port|socket] [-b log_file] [-r rollup_file [-R minutes,hours,days]]\n", name);
+    fprintf(stderr, "      [-f|--format text|json|csv|influx] command\n");
+    fprintf(stderr, "commands:\n");
+    fprintf(stderr, "  %s testcomm\n", name);
+    fprintf(stderr, "  %s getosccal\n", name);
+    fprintf(stderr, "  %s runadc [delay_ms]\n", name);
+    fprintf(stderr, "  %s runall\n", name);
+    fprintf(stderr, "  %s measure\n", name);
+    fprintf(stderr, "  %s getacc\n", name);
+    fprintf(stderr, "  %s getcnt\n", name);
+    fprintf(stderr, "  %s getadc\n", name);
+    fprintf(stderr, "  %s getrms\n", name);
+    fprintf(stderr, "  %s getcap\n", name);
+    fprintf(stderr, "  %s gethist\n", name);
+    fprintf(stderr, "  %s getreset\n", name);
+    fprintf(stderr, "  %s getenergy\n", name);
+    fprintf(stderr, "  %s getperf [reset]\n", name);
+    fprintf(stderr, "  %s getconfig\n", name);
+    fprintf(stderr, "  %s setconfig interval_ms [continuous] [gain20]\n", name);
+    fprintf(stderr, "  %s getlog [last_seq]\n", name);
+    fprintf(stderr, "  %s cycles [count]\n", name);
+    fprintf(stderr, "  %s daemon [period_ms [file]]\n", name);
+    fprintf(stderr, "  %s pollall [period_ms [directory]]\n", name);
+    fprintf(stderr, "  %s serial [new_serial]\n", name);
+    fprintf(stderr, "  %s openbench [count]\n", name);
+    fprintf(stderr, "  %s shmread shm_file [count]\n", name);
+    fprintf(stderr, "  %s dump|query log_file [from [to]]\n", name);
+    fprintf(stderr, "  %s rollup rollup_file [resolution_s [from [to]]]\n", name);
+#ifdef HAVE_HIDRAW
+    fprintf(stderr, "  %s /dev/hidrawN runadc|getacc|getcnt|getadc|read\n", name);
+#endif
+    fprintf(stderr, "\n");
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Output of measurement records in the format selected with -f (--format).
+ * A record is formatted into a buffer on the stack without printf and
+ * written with a single fwrite, so the stdio buffer decides how often the
+ * data is written out. The formats:
+ *   text    time accu cnt average (the daemon's format, no device)
+ *   json    {"time":1700000000.123,"device":"0A1F","accu":123456,"cnt":1500,"average":82.30}
+ *   csv     time,device,accu,cnt,average,rms,peak after a header line
+ *   influx  tinysct,device=0A1F accu=123456i,cnt=1500i,average=82.30 1700000000123000000
+ * time is in seconds since the epoch (ns in influx). rms and peak are only
+ * present if the firmware reported them (empty in csv).
+ */
+#define FORMAT_TEXT     0
+#define FORMAT_JSON     1
+#define FORMAT_CSV      2
+#define FORMAT_INFLUX   3
+
+static int  outputFormat = FORMAT_TEXT;
+
+typedef struct record{
+    int64_t     timeMs;     /* ms since the epoch */
+    const char  *device;    /* serial number, USB path or log file */
+    uint32_t    accu, cnt;
+    int         hasRms;     /* sq and peak are valid */
+    uint32_t    sq, peak;
+}record_t;
+
+static int  formatParse(char *name)
+{
+static const char   *names[] = {"text", "json", "csv", "influx"};
+int                 i;
+
+    for(i = 0; i < 4; i++){
+        if(strcmp(name, names[i]) == 0)
+            return outputFormat = i;
+    }
+    return -1;
+}
+
+/* Nonzero if command (with its first argument) writes records through
+ * recordWrite() and so honours -f. The others print single values.
+ */
+static int  formatCommand(char *command, char *argument)
+{
+static const char   *commands[] = {"measure", "runall", "daemon", "pollall", "dump", "shmread", NULL};
+int                 i;
+
+    if(strncmp(command, "/dev/", 5) == 0)   /* hidraw */
+        return argument != NULL && strcmp(argument, "read") == 0;
+    for(i = 0; commands[i] != NULL; i++){
+        if(strcmp(command, commands[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static char *fmtUnsigned(char *p, uint64_t value)
+{
+char    digits[20];
+int     n = 0;
+
+    do{
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    }while(value != 0);
+    while(n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/* value with 2 decimals, value >= 0 */
+static char *fmtFixed2(char *p, double value)
+{
+uint64_t    hundredths = (uint64_t)(value * 100 + 0.5);
+
+    p = fmtUnsigned(p, hundredths / 100);
+    *p++ = '.';
+    *p++ = '0' + hundredths / 10 % 10;
+    *p++ = '0' + hundredths % 10;
+    return p;
+}
+
+static char *fmtTime(char *p, int64_t timeMs)
+{
+    p = fmtUnsigned(p, timeMs / 1000);
+    *p++ = '.';
+    *p++ = '0' + timeMs / 100 % 10;
+    *p++ = '0' + timeMs / 10 % 10;
+    *p++ = '0' + timeMs % 10;
+    return p;
+}
+
+/* s with the characters quoted that the format does not allow, at most max
+ * characters of it.
+ */
+static char *fmtName(char *p, const char *s, int max)
+{
+    for(; *s != 0 && max > 0; s++, max--){
+        if(outputFormat == FORMAT_JSON ? *s == '"' || *s == '\\'
+                : outputFormat == FORMAT_INFLUX ? *s == ' ' || *s == ',' || *s == '='
+                : *s == ',' || *s == '"')
+            *p++ = outputFormat == FORMAT_CSV ? '_' : '\\';
+        if(outputFormat != FORMAT_CSV || (*s != ',' && *s != '"'))
+            *p++ = *s;
+    }
+    return p;
+}
+
+static char *fmtStr(char *p, const char *s)
+{
+    while(*s != 0)
+        *p++ = *s++;
+    return p;
+}
+
+/* Write r to fp. *started is 0 for a new stream (csv writes its header). */
+static void recordWrite(FILE *fp, record_t *r, int *started)
+{
+char    line[256], *p = line;
+double  average = r->cnt ? (double)r->accu / r->cnt : 0;
+double  rms = r->hasRms && r->cnt ? sqrt((double)r->sq / r->cnt) : 0;
+
+    switch(outputFormat){
+    case FORMAT_JSON:
+        p = fmtStr(p, "{\"time\":");
+        p = fmtTime(p, r->timeMs);
+        p = fmtStr(p, ",\"device\":\"");
+        p = fmtName(p, r->device, 64);
+        p = fmtStr(p, "\",\"accu\":");
+        p = fmtUnsigned(p, r->accu);
+        p = fmtStr(p, ",\"cnt\":");
+        p = fmtUnsigned(p, r->cnt);
+        p = fmtStr(p, ",\"average\":");
+        p = fmtFixed2(p, average);
+        if(r->hasRms){
+            p = fmtStr(p, ",\"rms\":");
+            p = fmtFixed2(p, rms);
+            p = fmtStr(p, ",\"peak\":");
+            p = fmtUnsigned(p, r->peak);
+        }
+        p = fmtStr(p, "}\n");
+        break;
+    case FORMAT_CSV:
+        if(!*started)
+            p = fmtStr(p, "time,device,accu,cnt,average,rms,peak\n");
+        p = fmtTime(p, r->timeMs);
+        *p++ = ',';
+        p = fmtName(p, r->device, 64);
+        *p++ = ',';
+        p = fmtUnsigned(p, r->accu);
+        *p++ = ',';
+        p = fmtUnsigned(p, r->cnt);
+        *p++ = ',';
+        p = fmtFixed2(p, average);
+        *p++ = ',';
+        if(r->hasRms){
+            p = fmtFixed2(p, rms);
+            *p++ = ',';
+            p = fmtUnsigned(p, r->peak);
+        }else{
+            *p++ = ',';
+        }
+        *p++ = '\n';
+        break;
+    case FORMAT_INFLUX:
+        p = fmtStr(p, "tinysct,device=");
+        p = fmtName(p, r->device, 64);
+        p = fmtStr(p, " accu=");
+        p = fmtUnsigned(p, r->accu);
+        p = fmtStr(p, "i,cnt=");
+        p = fmtUnsigned(p, r->cnt);
+        p = fmtStr(p, "i,average=");
+        p = fmtFixed2(p, average);
+        if(r->hasRms){
+            p = fmtStr(p, ",rms=");
+            p = fmtFixed2(p, rms);
+            p = fmtStr(p, ",peak=");
+            p = fmtUnsigned(p, r->peak);
+            *p++ = 'i';
+        }
+        *p++ = ' ';
+        p = fmtUnsigned(p, (uint64_t)r->timeMs * 1000000);
+        *p++ = '\n';
+        break;
+    default:
+        p = fmtTime(p, r->timeMs);
+        *p++ = ' ';
+        p = fmtUnsigned(p, r->accu);
+        *p++ = ' ';
+        p = fmtUnsigned(p, r->cnt);
+        *p++ = ' ';
+        p = fmtFixed2(p, average);
+        *p++ = '\n';
+        break;
+    }
+    *started = 1;
+    fwrite(line, p - line, 1, fp);
+}
+
+#ifndef NO_LIBUSB    /* used by the daemon */
+/* Mark a gap in the readings: in text as "# gap start end missed", as a
+ * record with gap_start and missed in json and influx; csv has no place
+ * for it.
+ */
+static void gapWrite(FILE *fp, const char *device, int64_t startMs, int64_t endMs, uint64_t missed)
+{
+char    line[256], *p = line;
+
+    switch(outputFormat){
+    case FORMAT_JSON:
+        p = fmtStr(p, "{\"time\":");
+        p = fmtTime(p, endMs);
+        p = fmtStr(p, ",\"device\":\"");
+        p = fmtName(p, device, 64);
+        p = fmtStr(p, "\",\"gap_start\":");
+        p = fmtTime(p, startMs);
+        p = fmtStr(p, ",\"missed\":");
+        p = fmtUnsigned(p, missed);
+        p = fmtStr(p, "}\n");
+        break;
+    case FORMAT_CSV:
+        return;
+    case FORMAT_INFLUX:
+        p = fmtStr(p, "tinysct_gap,device=");
+        p = fmtName(p, device, 64);
+        p = fmtStr(p, " gap_start=");
+        p = fmtTime(p, startMs);
+        p = fmtStr(p, ",missed=");
+        p = fmtUnsigned(p, missed);
+        *p++ = 'i';
+        *p++ = ' ';
+        p = fmtUnsigned(p, (uint64_t)endMs * 1000000);
+        *p++ = '\n';
+        break;
+    default:
+        p = fmtStr(p, "# gap ");
+        p = fmtTime(p, startMs);
+        *p++ = ' ';
+        p = fmtTime(p, endMs);
+        *p++ = ' ';
+        p = fmtUnsigned(p, missed);
+        *p++ = '\n';
+        break;
+    }
+    fwrite(line, p - line, 1, fp);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#ifdef HAVE_HIDRAW
+/* Measurement commands through the hidraw node of the device. The record in
+ * the input and feature reports is: 4 bytes sum, 2 bytes count, 1 byte
+ * sequence number, 1 byte flags (bit 0 = interval running), little endian.
+ */
+static int  hidrawMain(char *device, char *command)
+{
+unsigned char   buffer[1 + RECORD_SIZE];
+unsigned long   accu;
+unsigned int    cnt;
+int             fd, rval;
+
+    if((fd = open(device, O_RDWR)) < 0){
+        perror(device);
+        return 1;
+    }
+    memset(buffer, 0, sizeof(buffer));  /* buffer[0] = report ID 0, the device uses no report IDs */
+    if(strcmp(command, "runadc") == 0){
+        buffer[1] = HIDCMD_RUNADC;
+        rval = ioctl(fd, HIDIOCSFEATURE(sizeof(buffer)), buffer);
+    }else if(strcmp(command, "read") == 0){
+        rval = read(fd, buffer + 1, RECORD_SIZE);   /* blocks until the next interval completes */
+    }else{
+        rval = ioctl(fd, HIDIOCGFEATURE(sizeof(buffer)), buffer);
+        rval--;                                     /* report ID precedes the record */
+    }
+    if(rval < 0){
+        perror(device);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    if(strcmp(command, "runadc") == 0)
+        return 0;
+    if(rval < RECORD_SIZE){
+        fprintf(stderr, "only %d bytes of record received\n", rval);
+        return 1;
+    }
+    accu = buffer[1] + 256UL * buffer[2] + 65536UL * buffer[3] + 16777216UL * buffer[4];
+    cnt = buffer[5] + 256 * buffer[6];
+    if(buffer[8] & 1)   /* like the vendor requests, report 0 while an interval is running */
+        accu = cnt = 0;
+    if(strcmp(command, "getacc") == 0){
+        printf("%lu\n", accu);
+    }else if(strcmp(command, "getcnt") == 0){
+        printf("%u\n", cnt);
+    }else if(strcmp(command, "getadc") == 0){
+        printf("%lu\n", cnt ? (accu + cnt / 2) / cnt : 0);
+    }else if(strcmp(command, "read") == 0){
+        if(outputFormat == FORMAT_TEXT){
+            printf("%lu %u\n", accu, cnt);
+        }else{
+            record_t        rec;
+            struct timeval  tv;
+            int             started = 0;
+
+            gettimeofday(&tv, NULL);
+            memset(&rec, 0, sizeof(rec));
+            rec.timeMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+            rec.device = device;
+            rec.accu = accu;
+            rec.cnt = cnt;
+            recordWrite(stdout, &rec, &started);
+        }
+    }else{
+        fprintf(stderr, "command %s is not available through hidraw\n", command);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/* Print the latest reading, or the last count readings, which a daemon
+ * published in shm_file (see tinysctshm.h), in the format of the daemon or
+ * the one selected with -f. The device of the records is shm_file.
+ */
+static int  shmReadMain(char *fileName, int count)
+{
+tinysctShm_t        *shm, copy;
+tinysctReading_t    *r;
+record_t            rec;
+uint64_t            n;
+int                 fd, started = 0;
+
+    if((fd = open(fileName, O_RDONLY)) < 0){
+        perror(fileName);
+        return 1;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED){
+        perror(fileName);
+        return 1;
+    }
+    if(shm->magic != TINYSCT_SHM_MAGIC || shm->version != TINYSCT_SHM_VERSION){
+        fprintf(stderr, "%s: not a tinysct shared memory file of version %d\n", fileName, TINYSCT_SHM_VERSION);
+        return 1;
+    }
+    if(tinysctShmCopy(shm, &copy) != 0){
+        fprintf(stderr, "%s: update not finished, the daemon (pid %u) died during an update?\n", fileName, (unsigned)shm->pid);
+        return 1;
+    }
+    if(copy.count == 0){
+        fprintf(stderr, "%s: no readings yet\n", fileName);
+        return 1;
+    }
+    if(count < 1)
+        count = 1;
+    if(count > TINYSCT_SHM_HISTORY)
+        count = TINYSCT_SHM_HISTORY;
+    if((uint64_t)count > copy.count)
+        count = (int)copy.count;
+    for(n = copy.count - count; n < copy.count; n++){
+        r = &copy.history[n % TINYSCT_SHM_HISTORY];
+        rec.timeMs = r->timeMs;
+        rec.device = fileName;
+        rec.accu = r->accu;
+        rec.cnt = r->cnt;
+        rec.hasRms = (copy.flags & TINYSCT_SHM_RMS) != 0;
+        rec.sq = r->sq;
+        rec.peak = r->peak;
+        recordWrite(stdout, &rec, &started);
+    }
+    munmap(shm, sizeof(*shm));
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Binary log of the daemon (-b). The file is a sequence of blocks of
+ * LOG_BLOCK_SIZE bytes. A block starts with a checkpoint: a header with the
+ * first reading in full. The following readings are stored as differences
+ * to the previous one, each as three variable length integers: the time
+ * difference in ms (always > 0), then the differences of the sum and of the
+ * number of samples, zigzag encoded so that small negative numbers are
+ * short. A reading takes about 5 bytes instead of about 35 as text. The
+ * rest of a block is filled with 0 bytes, which cannot start a reading.
+ * The last block of the file may be incomplete. Since every block starts
+ * with a full reading, a time range is found with a binary search over the
+ * block headers and decoding starts right there.
+ */
+#define LOG_BLOCK_SIZE  4096
+#define LOG_MAGIC       0x4c537374  /* "tsSL" in a little endian file */
+#define LOG_RECORD_MAX  (10 + 5 + 5)    /* longest reading: time, sum and count difference */
+
+typedef struct logHeader{
+    uint32_t    magic;
+    uint32_t    accu;
+    int64_t     timeMs;     /* ms since the epoch */
+    uint32_t    cnt;
+    uint32_t    reserved;
+}logHeader_t;
+
+static const unsigned char  *varintGet(const unsigned char *p, const unsigned char *end, uint64_t *value)
+{
+int     shift = 0;
+
+    *value = 0;
+    while(p < end && shift < 64){
+        *value |= (uint64_t)(*p & 0x7f) << shift;
+        if(!(*p++ & 0x80))
+            return p;
+        shift += 7;
+    }
+    return NULL;    /* truncated */
+}
+
+static int64_t  unzigzag(uint64_t value)
+{
+    return value & 1 ? ~(int64_t)(value >> 1) : (int64_t)(value >> 1);
+}
+
+#ifndef NO_LIBUSB    /* the writer is used by the daemon */
+typedef struct logWriter{
+    FILE        *fp;
+    char        *fileName;
+    long        used;       /* bytes used in the current block, 0: no block */
+    int64_t     timeMs;     /* previous reading */
+    uint32_t    accu, cnt;
+}logWriter_t;
+
+static int  varintPut(unsigned char *p, uint64_t value)
+{
+int     n = 0;
+
+    while(value >= 0x80){
+        p[n++] = (unsigned char)value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = (unsigned char)value;
+    return n;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return value < 0 ? ((uint64_t)~value << 1) | 1 : (uint64_t)value << 1;
+}
+
+/* Open fileName for appending. A block left incomplete by the last run is
+ * closed, the next reading starts a new one. The stdio buffer holds a whole
+ * block, so the flash sees one write per block.
+ */
+static int  logOpen(logWriter_t *log, char *fileName)
+{
+long    size;
+
+    memset(log, 0, sizeof(*log));
+    log->fileName = fileName;
+    if((log->fp = fopen(fileName, "ab")) == NULL){
+        perror(fileName);
+        return 1;
+    }
+    setvbuf(log->fp, NULL, _IOFBF, LOG_BLOCK_SIZE);
+    fseek(log->fp, 0, SEEK_END);
+    size = ftell(log->fp);
+    if(size % LOG_BLOCK_SIZE != 0){
+        log->used = size % LOG_BLOCK_SIZE;
+        log->timeMs = INT64_MAX;    /* forces a new block */
+    }
+    return 0;
+}
+
+static void logAppend(logWriter_t *log, int64_t timeMs, uint32_t accu, uint32_t cnt)
+{
+unsigned char   record[LOG_RECORD_MAX];
+logHeader_t     header;
+int             n = 0;
+
+    if(log->used != 0 && timeMs > log->timeMs && timeMs - log->timeMs < 0xffffffffL){
+        n = varintPut(record, timeMs - log->timeMs);
+        n += varintPut(record + n, zigzag((int64_t)accu - log->accu));
+        n += varintPut(record + n, zigzag((int64_t)cnt - log->cnt));
+    }
+    if(n == 0 || log->used + n > LOG_BLOCK_SIZE){  /* start a new block */
+        for(; log->used != 0 && log->used < LOG_BLOCK_SIZE; log->used++)
+            putc(0, log->fp);
+        memset(&header, 0, sizeof(header));
+        header.magic = LOG_MAGIC;
+        header.accu = accu;
+        header.timeMs = timeMs;
+        header.cnt = cnt;
+        fwrite(&header, sizeof(header), 1, log->fp);
+        log->used = sizeof(header);
+    }else{
+        fwrite(record, n, 1, log->fp);
+        log->used += n;
+    }
+    log->timeMs = timeMs;
+    log->accu = accu;
+    log->cnt = cnt;
+}
+
+static void logClose(logWriter_t *log)
+{
+    if(log->fp != NULL)
+        fclose(log->fp);
+    log->fp = NULL;
+}
+
+/* For log rotation: the block in progress is completed in the new file. */
+static int  logReopen(logWriter_t *log)
+{
+    logClose(log);
+    return logOpen(log, log->fileName);
+}
+#endif
+
+/* Read side. The file is mapped, a block is decoded with logNext(). */
+typedef struct logReader{
+    const unsigned char *data;
+    long                size;
+    long                blocks;
+    const unsigned char *p, *end;   /* position in the current block */
+    int64_t             timeMs;
+    uint32_t            accu, cnt;
+}logReader_t;
+
+static int  logMap(logReader_t *r, char *fileName)
+{
+struct stat st;
+int         fd;
+
+    memset(r, 0, sizeof(*r));
+    if((fd = open(fileName, O_RDONLY)) < 0 || fstat(fd, &st) != 0){
+        perror(fileName);
+        return 1;
+    }
+    r->size = st.st_size;
+    r->blocks = (r->size + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+    if(r->size > 0 && (r->data = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        perror(fileName);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+static const logHeader_t    *logBlock(logReader_t *r, long block)
+{
+const logHeader_t   *h;
+long                start = block * LOG_BLOCK_SIZE;
+
+    if(start + (long)sizeof(*h) > r->size)
+        return NULL;
+    h = (const logHeader_t *)(r->data + start);
+    return h->magic == LOG_MAGIC ? h : NULL;
+}
+
+/* Position r at the start of block, on its first reading. */
+static int  logSeek(logReader_t *r, long block)
+{
+const logHeader_t   *h = logBlock(r, block);
+long                end = (block + 1) * LOG_BLOCK_SIZE;
+
+    if(h == NULL)
+        return 0;
+    r->p = (const unsigned char *)(h + 1);
+    r->end = r->data + (end < r->size ? end : r->size);
+    r->timeMs = h->timeMs;
+    r->accu = h->accu;
+    r->cnt = h->cnt;
+    return 1;
+}
+
+/* Advance to the next reading of the current block. Returns 0 at its end. */
+static int  logNext(logReader_t *r)
+{
+uint64_t    dt, da, dc;
+
+    if(r->p >= r->end || *r->p == 0)
+        return 0;
+    if((r->p = varintGet(r->p, r->end, &dt)) == NULL || (r->p = varintGet(r->p, r->end, &da)) == NULL
+            || (r->p = varintGet(r->p, r->end, &dc)) == NULL){
+        r->p = r->end;  /* cut off, e.g. by a crash */
+        return 0;
+    }
+    r->timeMs += dt;
+    r->accu += unzigzag(da);
+    r->cnt += unzigzag(dc);
+    return 1;
+}
+
+/* The last block that starts at or before timeMs (the first block if none). */
+static long logFind(logReader_t *r, int64_t timeMs)
+{
+const logHeader_t   *h;
+long                lo = 0, hi = r->blocks - 1, mid;
+
+    while(lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if((h = logBlock(r, mid)) != NULL && h->timeMs <= timeMs)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* dump: print the readings from..to (seconds since the epoch) as records,
+ * with the log file as the device. query: print the number of readings, the number of samples,
+ * the mean and the lowest and highest interval average in that range.
+ */
+static int  logMain(int argc, char **argv)
+{
+logReader_t r;
+int64_t     from = argc > 3 ? (int64_t)(atof(argv[3]) * 1000) : INT64_MIN;
+int64_t     to = argc > 4 ? (int64_t)(atof(argv[4]) * 1000) : INT64_MAX;
+int         dump = strcmp(argv[1], "dump") == 0, more, started = 0;
+record_t    rec;
+long        block;
+double      average, min = 0, max = 0;
+uint64_t    readings = 0, samples = 0, sum = 0;
+
+    if(logMap(&r, argv[2]) != 0)
+        return 1;
+    for(block = logFind(&r, from); block < r.blocks; block++){
+        for(more = logSeek(&r, block); more && r.timeMs <= to; more = logNext(&r)){
+            if(r.timeMs < from)
+                continue;
+            average = r.cnt ? (double)r.accu / r.cnt : 0;
+            if(dump){
+                memset(&rec, 0, sizeof(rec));
+                rec.timeMs = r.timeMs;
+                rec.device = argv[2];
+                rec.accu = r.accu;
+                rec.cnt = r.cnt;
+                recordWrite(stdout, &rec, &started);
+                continue;
+            }
+            if(readings == 0 || average < min)
+                min = average;
+            if(readings == 0 || average > max)
+                max = average;
+            readings++;
+            samples += r.cnt;
+            sum += r.accu;
+        }
+        if(more)    /* past the end of the range */
+            break;
+    }
+    if(!dump)
+        printf("%llu %llu %.2f %.2f %.2f\n", (unsigned long long)readings, (unsigned long long)samples,
+            samples ? (double)sum / samples : 0, min, max);
+    if(r.size > 0)
+        munmap((void *)r.data, r.size);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Rollups of the daemon (-r). The interval averages are summed up into
+ * buckets of a minute, an hour and a day, each with the number of readings,
+ * sum, sum of squares, lowest and highest average. Each tier is a ring of a
+ * fixed number of buckets (-R) in a memory mapped file, so the file keeps
+ * its size however long the daemon runs. A bucket belongs to the slot given
+ * by its start time; a bucket found in the slot with another start time has
+ * expired and is cleared when the slot is reused. Updates are protected by
+ * a sequence lock, like the shared memory file.
+ */
+#define ROLLUP_TIERS    3
+#define ROLLUP_MAGIC    0x52537374  /* "tsSR" in a little endian file */
+#define ROLLUP_VERSION  1
+
+static const int64_t    rollupSpanMs[ROLLUP_TIERS] = {60000, 3600000, 86400000};
+static const char       *rollupNames[ROLLUP_TIERS] = {"minute", "hour", "day"};
+
+typedef struct rollupBucket{
+    int64_t     startMs;    /* ms since the epoch, 0: empty */
+    uint32_t    count;
+    uint32_t    reserved;
+    double      sum, sumSq, min, max;
+}rollupBucket_t;
+
+typedef struct rollupHeader{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    seq;        /* sequence lock, odd during an update */
+    uint32_t    slots[ROLLUP_TIERS];    /* buckets per tier, the tiers follow the header */
+}rollupHeader_t;
+
+typedef struct rollup{
+    rollupHeader_t  *header;
+    rollupBucket_t  *tiers[ROLLUP_TIERS];
+    size_t          size;
+}rollup_t;
+
+static size_t   rollupSize(const uint32_t *slots)
+{
+size_t  size = sizeof(rollupHeader_t);
+int     i;
+
+    for(i = 0; i < ROLLUP_TIERS; i++)
+        size += slots[i] * sizeof(rollupBucket_t);
+    return size;
+}
+
+/* Map fileName. With slots != NULL (the daemon) the file is created, or
+ * cleared if its tiers have other sizes; otherwise it is mapped read-only.
+ */
+static int  rollupMap(rollup_t *r, char *fileName, const uint32_t *slots)
+{
+rollupHeader_t  header;
+struct stat     st;
+size_t          offset;
+int             fd, i, valid;
+
+    if((fd = open(fileName, slots != NULL ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0 || fstat(fd, &st) != 0){
+        perror(fileName);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    valid = read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == ROLLUP_MAGIC
+        && header.version == ROLLUP_VERSION && (size_t)st.st_size == rollupSize(header.slots);
+    if(slots != NULL && (!valid || memcmp(header.slots, slots, sizeof(header.slots)) != 0)){
+        memset(&header, 0, sizeof(header));
+        header.magic = ROLLUP_MAGIC;
+        header.version = ROLLUP_VERSION;
+        memcpy(header.slots, slots, sizeof(header.slots));
+        if(ftruncate(fd, 0) != 0 || ftruncate(fd, rollupSize(slots)) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+            perror(fileName);
+            close(fd);
+            return 1;
+        }
+    }else if(!valid){
+        fprintf(stderr, "%s: not a tinysct rollup file of version %d\n", fileName, ROLLUP_VERSION);
+        close(fd);
+        return 1;
+    }
+    r->size = rollupSize(header.slots);
+    r->header = mmap(NULL, r->size, slots != NULL ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r->header == MAP_FAILED){
+        perror(fileName);
+        return 1;
+    }
+    offset = sizeof(rollupHeader_t);
+    for(i = 0; i < ROLLUP_TIERS; i++){
+        r->tiers[i] = (rollupBucket_t *)((char *)r->header + offset);
+        offset += header.slots[i] * sizeof(rollupBucket_t);
+    }
+    return 0;
+}
+
+/* The writer, used by the daemon and by testrollup.c. */
+static void __attribute__((unused)) rollupAdd(rollup_t *r, int64_t timeMs, double value)
+{
+rollupBucket_t  *b;
+int64_t         start;
+int             i;
+
+    if(r->header->seq & 1)  /* a daemon died during an update */
+        r->header->seq++;
+    __atomic_store_n(&r->header->seq, r->header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(i = 0; i < ROLLUP_TIERS; i++){
+        if(r->header->slots[i] == 0)
+            continue;
+        start = timeMs - timeMs % rollupSpanMs[i];
+        b = &r->tiers[i][(start / rollupSpanMs[i]) % r->header->slots[i]];
+        if(b->startMs != start || b->count == 0){   /* expired or empty */
+            memset(b, 0, sizeof(*b));
+            b->startMs = start;
+            b->min = b->max = value;
+        }
+        b->count++;
+        b->sum += value;
+        b->sumSq += value * value;
+        if(value < b->min)
+            b->min = value;
+        if(value > b->max)
+            b->max = value;
+    }
+    __atomic_store_n(&r->header->seq, r->header->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void rollupPrint(rollupBucket_t *b)
+{
+double  mean = b->sum / b->count;
+
+    printf("%lld %lu %.2f %.2f %.2f %.2f\n", (long long)(b->startMs / 1000), (unsigned long)b->count, mean, b->min, b->max,
+        sqrt(fmax(b->sumSq / b->count - mean * mean, 0)));
+}
+
+/* Print the rollups between from and to (seconds since the epoch) with a
+ * resolution of resolution seconds. They are read from the coarsest tier
+ * whose buckets are not longer than that, and merged if the resolution is
+ * coarser than the tier. One line per period: start (seconds since the
+ * epoch), number of readings, mean, lowest and highest interval average and
+ * standard deviation.
+ */
+static int  rollupMain(int argc, char **argv)
+{
+rollup_t        r;
+rollupBucket_t  *copy, *b, sum;
+double          resolutionMs = (argc > 3 ? atof(argv[3]) : 60) * 1000;
+int64_t         from = argc > 4 ? (int64_t)(atof(argv[4]) * 1000) : INT64_MIN;
+int64_t         to = argc > 5 ? (int64_t)(atof(argv[5]) * 1000) : INT64_MAX;
+int64_t         period, start, expired;
+uint32_t        seq, slots, i, k, first;
+int             tier;
+
+    if(rollupMap(&r, argv[2], NULL) != 0)
+        return 1;
+    for(tier = ROLLUP_TIERS - 1; tier > 0 && (rollupSpanMs[tier] > resolutionMs || r.header->slots[tier] == 0); tier--)
+        ;
+    slots = r.header->slots[tier];
+    period = (int64_t)resolutionMs < rollupSpanMs[tier] ? rollupSpanMs[tier] : (int64_t)resolutionMs;
+    fprintf(stderr, "from the %s tier, %u buckets\n", rollupNames[tier], slots);
+    if(slots == 0 || (copy = malloc(slots * sizeof(*copy))) == NULL)
+        return 1;
+    do{ /* copy the tier consistently */
+        while((seq = __atomic_load_n(&r.header->seq, __ATOMIC_ACQUIRE)) & 1)
+            usleep(1000);
+        memcpy(copy, r.tiers[tier], slots * sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&r.header->seq, __ATOMIC_RELAXED) != seq);
+    munmap(r.header, r.size);
+    /* The ring is in time order from the slot after the newest bucket. A
+     * slot which got no reading during the last lap of the ring (the daemon
+     * was stopped) still holds a bucket of an earlier lap, which has expired.
+     */
+    for(i = first = 0; i < slots; i++){
+        if(copy[i].startMs > copy[first].startMs)
+            first = i;
+    }
+    expired = copy[first].startMs - (int64_t)slots * rollupSpanMs[tier];
+    memset(&sum, 0, sizeof(sum));
+    for(k = 1; k <= slots; k++){
+        b = &copy[(first + k) % slots];
+        if(b->count == 0 || b->startMs <= expired || b->startMs < from || b->startMs > to)
+            continue;
+        start = b->startMs - b->startMs % period;
+        if(sum.count != 0 && sum.startMs != start){
+            rollupPrint(&sum);
+            sum.count = 0;
+        }
+        if(sum.count == 0){
+            sum = *b;
+            sum.startMs = start;
+        }else{
+            sum.count += b->count;
+            sum.sum += b->sum;
+            sum.sumSq += b->sumSq;
+            sum.min = fmin(sum.min, b->min);
+            sum.max = fmax(sum.max, b->max);
+        }
+    }
+    if(sum.count != 0)
+        rollupPrint(&sum);
+    free(copy);
+    return 0;
+}
+
+#ifndef NO_LIBUSB
+
+static libusb_context   *usbContext;
+
+/* tinysct uses the free shared default VID/PID. If you want to see an
+ * example device lookup where an individually reserved PID is used, see our
+ * RemoteSensor reference implementation.
+ */
+
+#define USB_ERROR_NOTFOUND  1
+#define USB_ERROR_ACCESS    2
+#define USB_ERROR_IO        3
+
+static char *selectPath;    /* -p: bus/port path of the device */
+static char *selectSerial;  /* -s: serial number of the device */
+static char *cacheFile;     /* -c: file with the path the last lookup resolved */
+static char *shmFile;       /* -m: file in which the daemon publishes its readings */
+static char *exporterAddress;   /* -e: address of the metrics exporter of the daemon */
+static char *binaryLogFile;     /* -b: binary log of the daemon */
+static char *rollupFile;        /* -r: rollups of the daemon */
+static uint32_t rollupSlots[ROLLUP_TIERS] = {1440, 744, 732};  /* -R: a day of minutes, a month of hours, two years of days */
+
+/* Compare string descriptor index of the open device with expected. Returns
+ * 1 if it matches, otherwise 0 and sets *errorCode.
+ */
+static int  usbCheckString(libusb_device_handle *handle, int index, char *expected, int *errorCode)
+{
+unsigned char   string[256];
+int             rval;
+
+    if(index == 0){ /* the device has no such string */
+        *errorCode = USB_ERROR_NOTFOUND;
+        return 0;
+    }
+    rval = libusb_get_string_descriptor_ascii(handle, index, string, sizeof(string));
+    if(rval < 0){
+        *errorCode = USB_ERROR_IO;
+        fprintf(stderr, "Warning: cannot query string %d of device: %s\n", index, libusb_strerror(rval));
+        return 0;
+    }
+    *errorCode = USB_ERROR_NOTFOUND;
+    /* fprintf(stderr, "seen string ->%s<-\n", string); */
+    return strcmp((char *)string, expected) == 0;
+}
+
+/* Open dev and check its vendor and product names and, if serial is not
+ * NULL, its serial number. Returns the open handle or NULL and sets
+ * *errorCode.
+ */
+static libusb_device_handle *usbMatchDevice(libusb_device *dev, struct libusb_device_descriptor *descriptor, char *vendorName, char *productName, char *serial, int *errorCode)
+{
+libusb_device_handle    *handle;
+int                     rval;
+
+    if((rval = libusb_open(dev, &handle)) != 0){    /* we need to open the device in order to query strings */
+        *errorCode = USB_ERROR_ACCESS;
+        fprintf(stderr, "Warning: cannot open USB device: %s\n", libusb_strerror(rval));
+        return NULL;
+    }
+    if(vendorName == NULL && productName == NULL && serial == NULL){    /* name does not matter */
+        return handle;
+    }
+    /* now check whether the names match: */
+    if((vendorName == NULL || usbCheckString(handle, descriptor->iManufacturer, vendorName, errorCode))
+        && (productName == NULL || usbCheckString(handle, descriptor->iProduct, productName, errorCode))
+        && (serial == NULL || usbCheckString(handle, descriptor->iSerialNumber, serial, errorCode)))
+        return handle;
+    libusb_close(handle);
+    return NULL;
+}
+
+/* Write the bus/port path of dev to path, in the form Linux uses in sysfs,
+ * e.g. "1-1.4" for port 4 of the hub on port 1 of bus 1.
+ */
+static char *usbDevicePath(libusb_device *dev, char *path, int size)
+{
+uint8_t ports[7];
+int     i, n, len;
+
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+    for(i = 0; i < n && len < size; i++)
+        len += snprintf(path + len, size - len, "%c%d", i == 0 ? '-' : '.', ports[i]);
+    return path;
+}
+
+/* Name of an open device for the output: its serial number, or its USB path
+ * if it has none (firmware without TINYSCT_CFG_SERIAL).
+ */
+static char *usbDeviceName(libusb_device_handle *handle, char *name, int size)
+{
+struct libusb_device_descriptor descriptor;
+libusb_device                   *dev = libusb_get_device(handle);
+
+    if(libusb_get_device_descriptor(dev, &descriptor) == 0 && descriptor.iSerialNumber != 0
+            && libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, (unsigned char *)name, size) > 0)
+        return name;
+    return usbDevicePath(dev, name, size);
+}
+
+static int usbInit(void)
+{
+    return usbContext != NULL || libusb_init(&usbContext) == 0;
+}
+
+/* Open the device at path. The bus is enumerated from the operating system's
+ * cache, without any traffic to the devices; only the device at path is
+ * opened and checked with a single string descriptor, the serial number if
+ * one is given, otherwise the product name.
+ */
+static libusb_device_handle *usbOpenPath(char *path, int vendor, int product, char *productName, char *serial, int *errorCode)
+{
+libusb_device                   **list;
+struct libusb_device_descriptor descriptor;
+libusb_device_handle            *handle = NULL;
+char                            devPath[32];
+ssize_t                         count, i;
+int                             rval;
+
+    *errorCode = USB_ERROR_NOTFOUND;
+    if(!usbInit() || (count = libusb_get_device_list(usbContext, &list)) < 0){
+        *errorCode = USB_ERROR_IO;
+        return NULL;
+    }
+    for(i = 0; i < count; i++){
+        if(strcmp(usbDevicePath(list[i], devPath, sizeof(devPath)), path) != 0)
+            continue;
+        if(libusb_get_device_descriptor(list[i], &descriptor) != 0 || descriptor.idVendor != vendor || descriptor.idProduct != product)
+            break;
+        if((rval = libusb_open(list[i], &handle)) != 0){
+            *errorCode = USB_ERROR_ACCESS;
+            fprintf(stderr, "Warning: cannot open USB device: %s\n", libusb_strerror(rval));
+            break;
+        }
+        if(serial != NULL ? !usbCheckString(handle, descriptor.iSerialNumber, serial, errorCode)
+                : !usbCheckString(handle, descriptor.iProduct, productName, errorCode)){
+            libusb_close(handle);
+            handle = NULL;
+        }
+        break;
+    }
+    libusb_free_device_list(list, 1);
+    if(handle != NULL)
+        *errorCode = 0;
+    return handle;
+}
+
+/* Open up to maxDevices matching devices. Returns the number of devices
+ * opened; if none is found, *errorCode tells why.
+ */
+static int usbOpenDevices(libusb_device_handle **devices, int maxDevices, int vendor, char *vendorName, int product, char *productName, char *serial, int *errorCode)
+{
+libusb_device                   **list;
+struct libusb_device_descriptor descriptor;
+libusb_device_handle            *handle;
+ssize_t                         count, i;
+int                             n = 0;
+
+    *errorCode = USB_ERROR_NOTFOUND;
+    if(!usbInit()){
+        *errorCode = USB_ERROR_IO;
+        return 0;
+    }
+    if((count = libusb_get_device_list(usbContext, &list)) < 0){
+        *errorCode = USB_ERROR_IO;
+        return 0;
+    }
+    for(i = 0; i < count && n < maxDevices; i++){
+        if(libusb_get_device_descriptor(list[i], &descriptor) != 0)
+            continue;
+        if(descriptor.idVendor == vendor && descriptor.idProduct == product){
+            handle = usbMatchDevice(list[i], &descriptor, vendorName, productName, serial, errorCode);
+            if(handle != NULL)
+                devices[n++] = handle;
+        }
+    }
+    libusb_free_device_list(list, 1);
+    if(n > 0)
+        *errorCode = 0;
+    return n;
+}
+
+/* The cache file holds one line: the serial number asked for ("-" for any
+ * device) and the path of the device that was found for it.
+ */
+static int  cacheRead(char *path, int size)
+{
+FILE    *fp;
+char    key[128], format[32];
+int     rval = 0;
+
+    if(cacheFile == NULL || (fp = fopen(cacheFile, "r")) == NULL)
+        return 0;
+    snprintf(format, sizeof(format), "%%127s %%%ds", size - 1);
+    if(fscanf(fp, format, key, path) == 2)
+        rval = strcmp(key, selectSerial != NULL ? selectSerial : "-") == 0;
+    fclose(fp);
+    return rval;
+}
+
+static void cacheWrite(libusb_device_handle *handle)
+{
+FILE    *fp;
+char    path[32];
+
+    if(cacheFile == NULL || (fp = fopen(cacheFile, "w")) == NULL)
+        return;
+    fprintf(fp, "%s %s\n", selectSerial != NULL ? selectSerial : "-", usbDevicePath(libusb_get_device(handle), path, sizeof(path)));
+    fclose(fp);
+}
+
+/* Open the device selected on the command line: the one at the given path,
+ * the one at the cached path if it still passes the check, or the first one
+ * the full scan finds.
+ */
+static int usbOpenDevice(libusb_device_handle **device, int vendor, char *vendorName, int product, char *productName)
+{
+char    path[32];
+int     errorCode;
+
+    if(selectPath != NULL){
+        *device = usbOpenPath(selectPath, vendor, product, productName, selectSerial, &errorCode);
+        return errorCode;
+    }
+    if(cacheRead(path, sizeof(path)) && (*device = usbOpenPath(path, vendor, product, productName, selectSerial, &errorCode)) != NULL)
+        return 0;
+    usbOpenDevices(device, 1, vendor, vendorName, product, productName, selectSerial, &errorCode);
+    if(errorCode == 0)
+        cacheWrite(*device);
+    return errorCode;
+}
+
+static double   monotonicMs(void)
+{
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Time the device lookup: the full scan, which opens every device with our
+ * VID/PID and reads its names, against the lookup by path (also used for a
+ * cached path), which opens only the device at the path and reads one string.
+ */
+static int  openBench(int count)
+{
+libusb_device_handle    *handle;
+char                    path[32];
+double                  start, scanMs, pathMs;
+int                     i, errorCode;
+
+    if(count < 1)
+        count = 1;
+    if(usbOpenDevices(&handle, 1, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct", selectSerial, &errorCode) == 0){
+        fprintf(stderr, "Could not find USB device \"tinysct\" with vid=0x%x pid=0x%x\n", USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT);
+        return 1;
+    }
+    usbDevicePath(libusb_get_device(handle), path, sizeof(path));
+    libusb_close(handle);
+    start = monotonicMs();
+    for(i = 0; i < count; i++){
+        if(usbOpenDevices(&handle, 1, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct", selectSerial, &errorCode) == 0){
+            fprintf(stderr, "device lost in iteration %d\n", i);
+            return 1;
+        }
+        libusb_close(handle);
+    }
+    scanMs = (monotonicMs() - start) / count;
+    start = monotonicMs();
+    for(i = 0; i < count; i++){
+        if((handle = usbOpenPath(path, USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT, "tinysct", selectSerial, &errorCode)) == NULL){
+            fprintf(stderr, "device lost in iteration %d\n", i);
+            return 1;
+        }
+        libusb_close(handle);
+    }
+    pathMs = (monotonicMs() - start) / count;
+    printf("device at %s   full scan: %.2f ms   by path: %.2f ms   (average of %d opens)\n", path, scanMs, pathMs, count);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Asynchronous control transfers. Any number of requests, to one device or
+ * to many, can be in flight at the same time; controlWait() runs the libusb
+ * event loop until all of them are complete. The completion callback notes
+ * the time, so the caller knows when each device answered.
+ */
+typedef struct controlRequest{
+    struct libusb_transfer  *transfer;
+    unsigned char           buffer[LIBUSB_CONTROL_SETUP_SIZE + 8];
+    unsigned char           *data;      /* reply, in buffer */
+    int                     result;     /* bytes received or libusb error */
+    double                  doneMs;     /* monotonic time of completion */
+    int                     *pending;
+}controlRequest_t;
+
+static void LIBUSB_CALL controlDone(struct libusb_transfer *transfer)
+{
+controlRequest_t    *r = transfer->user_data;
+
+    r->doneMs = monotonicMs();
+    switch(transfer->status){
+    case LIBUSB_TRANSFER_COMPLETED: r->result = transfer->actual_length; break;
+    case LIBUSB_TRANSFER_TIMED_OUT: r->result = LIBUSB_ERROR_TIMEOUT; break;
+    case LIBUSB_TRANSFER_STALL:     r->result = LIBUSB_ERROR_PIPE; break;
+    case LIBUSB_TRANSFER_NO_DEVICE: r->result = LIBUSB_ERROR_NO_DEVICE; break;
+    default:                        r->result = LIBUSB_ERROR_IO; break;
+    }
+    (*r->pending)--;
+}
+
+/* Submit an IN control transfer of up to 8 bytes. Returns 0 or a libusb error. */
+static int  controlSubmit(controlRequest_t *r, libusb_device_handle *handle, int requestType, int request, int value, int index, int *pending)
+{
+int     rval;
+
+    if(r->transfer == NULL && (r->transfer = libusb_alloc_transfer(0)) == NULL)
+        return r->result = LIBUSB_ERROR_NO_MEM;
+    libusb_fill_control_setup(r->buffer, requestType | LIBUSB_ENDPOINT_IN, request, value, index, sizeof(r->buffer) - LIBUSB_CONTROL_SETUP_SIZE);
+    libusb_fill_control_transfer(r->transfer, handle, r->buffer, controlDone, r, 5000);
+    r->data = libusb_control_transfer_get_data(r->transfer);
+    r->pending = pending;
+    if((rval = libusb_submit_transfer(r->transfer)) != 0)
+        return r->result = rval;
+    (*pending)++;
+    return 0;
+}
+
+static void controlWait(int *pending)
+{
+    while(*pending > 0)
+        libusb_handle_events(usbContext);   /* the transfers complete or time out */
+}
+
+static void controlFree(controlRequest_t *requests, int n)
+{
+int     i;
+
+    for(i = 0; i < n; i++){
+        if(requests[i].transfer != NULL)
+            libusb_free_transfer(requests[i].transfer);
+    }
+}
+
+/* Delay in ms from now to start, for the wValue of CLICMD_RUNADC and
+ * CLICMD_MEASURE. It is computed right before each request is submitted, so a
+ * device whose request goes out later is told to wait correspondingly less.
+ * Returns 0 if start has passed.
+ */
+static int  startDelay(double start)
+{
+int     delay = (int)(start - monotonicMs() + 0.5);
+
+    return delay > 0 ? delay : 0;
+}
+
+/* Start an interval on all devices at the same time. The requests are all in
+ * flight together, so they reach the devices within about a frame of each
+ * other; each device is told to wait for the time until the common start,
+ * which the firmware counts in ~1 ms timer ticks. The results are read from
+ * the HID feature reports, again in parallel.
+ */
+static int runAll(libusb_device_handle **devices, int n)
+{
+controlRequest_t    requests[MAX_DEVICES];
+double              start, now;
+struct timeval      tv;
+record_t            rec;
+char                name[64];
+int                 i, delay, pending = 0, errors = 0, started = 0;
+
+    memset(requests, 0, sizeof(requests));
+    start = monotonicMs() + RUNALL_MARGIN_MS;
+    for(i = 0; i < n; i++){
+        if((delay = startDelay(start)) < 1){
+            fprintf(stderr, "device %d: start time missed\n", i);
+            delay = 1;
+        }
+        controlSubmit(&requests[i], devices[i], LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, CLICMD_RUNADC, delay, 0, &pending);
+    }
+    controlWait(&pending);
+    for(i = 0; i < n; i++){
+        if(requests[i].result < 0){
+            fprintf(stderr, "device %d: USB error: %s\n", i, libusb_strerror(requests[i].result));
+            errors++;
+        }else if(requests[i].doneMs > start){
+            fprintf(stderr, "device %d: start time missed by %.1f ms\n", i, requests[i].doneMs - start);
+        }
+    }
+    if(errors){
+        controlFree(requests, n);
+        return 1;
+    }
+    /* wait for the interval to complete, then read the HID feature reports */
+    now = monotonicMs();
+    if(start + INTERVAL_MS > now)
+        usleep((useconds_t)((start + INTERVAL_MS - now) * 1000));
+    for(i = 0; i < n; i++)
+        requests[i].result = -1;    /* not read yet */
+    do{
+        for(i = 0; i < n; i++){
+            if(requests[i].result >= RECORD_SIZE && !(requests[i].data[7] & 1))
+                continue;   /* done */
+            controlSubmit(&requests[i], devices[i], LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, HID_GET_REPORT, HID_REPORT_FEATURE << 8, 0, &pending);
+        }
+        controlWait(&pending);
+        for(i = 0; i < n; i++){
+            if(requests[i].result < 0){
+                fprintf(stderr, "device %d: USB error: %s\n", i, libusb_strerror(requests[i].result));
+                controlFree(requests, n);
+                return 1;
+            }
+            if(requests[i].result < RECORD_SIZE){
+                fprintf(stderr, "device %d: only %d bytes received\n", i, requests[i].result);
+                controlFree(requests, n);
+                return 1;
+            }
+        }
+        for(i = 0; i < n && !(requests[i].data[7] & 1); i++)
+            ;
+        if(i < n)   /* still running */
+            usleep(1000);
+    }while(i < n);
+    gettimeofday(&tv, NULL);
+    memset(&rec, 0, sizeof(rec));
+    for(i = 0; i < n; i++){
+        unsigned char   *record = requests[i].data;
+        if(outputFormat == FORMAT_TEXT){
+            printf("%d %lu %d\n", i, record[0] + 256UL * record[1] + 65536UL * record[2] + 16777216UL * record[3], record[4] + 256 * record[5]);
+            continue;
+        }
+        rec.timeMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        rec.device = usbDeviceName(devices[i], name, sizeof(name));
+        rec.accu = record[0] + 256UL * record[1] + 65536UL * record[2] + 16777216UL * record[3];
+        rec.cnt = record[4] + 256 * record[5];
+        recordWrite(stdout, &rec, &started);
+    }
+    controlFree(requests, n);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Measure one interval, with CLICMD_MEASURE if the firmware implements it,
+ * otherwise with CLICMD_RUNADC and the HID feature report. Returns 0 or a
+ * negative libusb error.
+ */
+static int  measureOnce(libusb_device_handle *handle, unsigned long *accu, unsigned int *cnt)
 {
-    fprintf(stderr, "usage:\n");
-    fprintf(stderr, "  %s testcomm\n", name);
-    fprintf(stderr, "  %s getosccal\n", name);
-    fprintf(stderr, "  %s runadc\n", name);
-    fprintf(stderr, "  %s getacc\n", name);
-    fprintf(stderr, "  %s getcnt\n", name);
-    fprintf(stderr, "  %s getadc\n\n", name);
+static int      noMeasure;
+unsigned char   buffer[8];
+int             nBytes;
+
+    if(!noMeasure){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_MEASURE, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 0)
+            return nBytes;
+        if(nBytes < 6){
+            noMeasure = 1;  /* firmware without TINYSCT_CFG_MEASURE */
+            return measureOnce(handle, accu, cnt);
+        }
+    }else{
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_RUNADC, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 0)
+            return nBytes;
+        usleep(INTERVAL_MS * 1000);
+        do{
+            nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN, HID_GET_REPORT, HID_REPORT_FEATURE << 8, 0, buffer, sizeof(buffer), 5000);
+            if(nBytes < 0)
+                return nBytes;
+            if(nBytes < RECORD_SIZE)
+                return -1;
+            if(buffer[7] & 1)   /* still running */
+                usleep(1000);
+        }while(buffer[7] & 1);
+    }
+    *accu = buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3];
+    *cnt = buffer[4] + 256 * buffer[5];
+    return 0;
+}
+
+static volatile sig_atomic_t    daemonStop, daemonReopen;
+static int                      hotplugArrived;
+
+static void daemonSignal(int sig)
+{
+    if(sig == SIGHUP)
+        daemonReopen = 1;
+    else
+        daemonStop = 1;
+}
+
+static int LIBUSB_CALL hotplugCallback(libusb_context *context, libusb_device *dev, libusb_hotplug_event event, void *userData)
+{
+    hotplugArrived = 1;     /* the device is opened outside of the callback */
+    return 0;
+}
+
+/* Wait for ms, or until a tinysct device arrives. The libusb events are
+ * handled while waiting, which delivers the hot-plug notification; on
+ * platforms without hot-plug support this is a plain sleep.
+ */
+static void daemonWait(double ms)
+{
+struct timeval  tv;
+double          end = monotonicMs() + ms, left;
+
+    while(!hotplugArrived && !daemonStop && (left = end - monotonicMs()) > 0){
+        tv.tv_sec = (long)(left / 1000);
+        tv.tv_usec = (long)((left - tv.tv_sec * 1000.0) * 1000);
+        libusb_handle_events_timeout_completed(usbContext, &tv, &hotplugArrived);
+    }
 }
 
+/* Move next to the first slot of the schedule that is not in the past, so
+ * the start times stay on the grid of the period however late we are.
+ */
+static double   daemonSchedule(double next, double period)
+{
+double  now = monotonicMs();
+
+    if(period > 0 && next < now)
+        next += period * ceil((now - next) / period);
+    return next;
+}
 
-static int  usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen)
+/* The records of the daemon and pollall are fully buffered. Returns 1 if the
+ * output must be flushed now because the next record, due at about
+ * next + INTERVAL_MS, would come later than DAEMON_FLUSH_MS after the last
+ * flush at *flushed. Back to back intervals are then written a second's
+ * worth at a time, while a slow schedule still gets each record out at once.
+ */
+static int  daemonFlushDue(double *flushed, double next)
 {
-char    buffer[256];
-int     rval, i;
+double  now = monotonicMs();
 
-    if((rval = usb_control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) + index, langid, buffer, sizeof(buffer), 1000)) < 0)
-        return rval;
-    if(buffer[1] != USB_DT_STRING)
+    if(next < now)
+        next = now;
+    if(next + INTERVAL_MS <= *flushed + DAEMON_FLUSH_MS)
         return 0;
-    if((unsigned char)buffer[0] < rval)
-        rval = (unsigned char)buffer[0];
-    rval /= 2;
-    /* lossy conversion to ISO Latin1 */
-    for(i=1;i<rval;i++){
-        if(i > buflen)  /* destination buffer overflow */
-            break;
-        buf[i-1] = buffer[2 * i];
-        if(buffer[2 * i + 1] != 0)  /* outside of ISO Latin1 range */
-            buf[i-1] = '?';
+    *flushed = now;
+    return 1;
+}
+
+static void shmInit(tinysctShm_t *shm)
+{
+    if(shm->seq & 1)    /* a daemon died during an update */
+        shm->seq++;
+    tinysctShmBegin(shm);
+    shm->magic = TINYSCT_SHM_MAGIC;
+    shm->version = TINYSCT_SHM_VERSION;
+    shm->pid = getpid();
+    shm->count = shm->samples = 0;
+    shm->usbErrors = shm->gaps = 0;
+    shm->flags = shm->energyAccu = shm->energyCnt = 0;
+    memset(&shm->latest, 0, sizeof(shm->latest));
+    memset(shm->history, 0, sizeof(shm->history));
+    tinysctShmEnd(shm);
+}
+
+/* Create or reuse shmFile and map it for the daemon. Readers that have it
+ * mapped already see the reset of the counters.
+ */
+static tinysctShm_t *shmCreate(char *fileName)
+{
+tinysctShm_t    *shm;
+int             fd;
+
+    if((fd = open(fileName, O_RDWR | O_CREAT, 0644)) < 0){
+        perror(fileName);
+        return NULL;
+    }
+    if(ftruncate(fd, sizeof(*shm)) != 0){
+        perror(fileName);
+        close(fd);
+        return NULL;
     }
-    buf[i-1] = 0;
-    return i-1;
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED){
+        perror(fileName);
+        return NULL;
+    }
+    shmInit(shm);
+    return shm;
 }
 
+static void shmPublish(tinysctShm_t *shm, tinysctReading_t *r, int flags, uint32_t *energy)
+{
+    tinysctShmBegin(shm);
+    shm->history[shm->count % TINYSCT_SHM_HISTORY] = *r;
+    shm->latest = *r;
+    shm->count++;
+    shm->samples += r->cnt;
+    shm->flags = flags;
+    shm->energyAccu = energy[0];
+    shm->energyCnt = energy[1];
+    tinysctShmEnd(shm);
+}
 
-/* tinysct uses the free shared default VID/PID. If you want to see an
- * example device lookup where an individually reserved PID is used, see our
- * RemoteSensor reference implementation.
+/* Read the RMS and peak of the last interval and the energy counters for
+ * the shared state, as far as the firmware implements them: flags tells
+ * which to read, a missing one is removed. Returns the remaining flags or a
+ * negative libusb error.
  */
+static int  measureExtras(libusb_device_handle *handle, int flags, tinysctReading_t *r, uint32_t *energy)
+{
+unsigned char   buffer[8];
+int             nBytes;
 
-#define USB_ERROR_NOTFOUND  1
-#define USB_ERROR_ACCESS    2
-#define USB_ERROR_IO        3
+    if(flags & TINYSCT_SHM_RMS){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETRMS, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 0)
+            return nBytes;
+        if(nBytes < 8){
+            flags &= ~TINYSCT_SHM_RMS;
+        }else{
+            r->sq = buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3];
+            r->peak = buffer[6] + 256 * buffer[7];
+        }
+    }
+    if(flags & TINYSCT_SHM_ENERGY){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETNRG, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 0)
+            return nBytes;
+        if(nBytes < 6){
+            flags &= ~TINYSCT_SHM_ENERGY;
+        }else{
+            energy[0] = buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3];
+            energy[1] = buffer[4] + 256 * buffer[5];
+        }
+    }
+    return flags;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Metrics exporter: a thread that answers every HTTP request with the state
+ * of the daemon in the Prometheus text format. The state is copied under its
+ * sequence lock, so a scrape takes microseconds and never waits for the
+ * device. The address is a port on 127.0.0.1, host:port, or the path of a
+ * Unix socket.
+ */
+static int  exporterFd = -1;
+
+static int  exporterListen(char *address)
+{
+struct sockaddr_un  un;
+struct sockaddr_in  in;
+char                host[64] = "127.0.0.1", *colon;
+int                 fd, one = 1;
+
+    if(strchr(address, '/') != NULL){
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, address, sizeof(un.sun_path) - 1);
+        unlink(address);    /* left over from the last run */
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&un, sizeof(un)) != 0){
+            perror(address);
+            return -1;
+        }
+    }else{
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        if((colon = strrchr(address, ':')) != NULL){
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+            address = colon + 1;
+        }
+        in.sin_port = htons(atoi(address));
+        if(inet_pton(AF_INET, host, &in.sin_addr) != 1){
+            fprintf(stderr, "%s: not an IPv4 address\n", host);
+            return -1;
+        }
+        if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+            perror("socket");
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, (struct sockaddr *)&in, sizeof(in)) != 0){
+            perror(address);
+            close(fd);
+            return -1;
+        }
+    }
+    if(listen(fd, 8) != 0){
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int  exporterFormat(tinysctShm_t *state, char *text, int size)
+{
+tinysctShm_t        s;
+tinysctReading_t    *r = &s.latest;
+int                 len;
+
+    if(tinysctShmCopy(state, &s) != 0)
+        return -1;
+    len = snprintf(text, size,
+        "# HELP tinysct_average Average absolute ADC value of the last interval, proportional to the current.\n"
+        "# TYPE tinysct_average gauge\n"
+        "tinysct_average %.3f\n"
+        "# HELP tinysct_samples Number of samples of the last interval.\n"
+        "# TYPE tinysct_samples gauge\n"
+        "tinysct_samples %lu\n"
+        "# HELP tinysct_last_reading_timestamp_seconds End of the last interval.\n"
+        "# TYPE tinysct_last_reading_timestamp_seconds gauge\n"
+        "tinysct_last_reading_timestamp_seconds %.3f\n"
+        "# HELP tinysct_readings_total Intervals measured by the daemon.\n"
+        "# TYPE tinysct_readings_total counter\n"
+        "tinysct_readings_total %llu\n"
+        "# HELP tinysct_samples_total Samples in all intervals measured by the daemon.\n"
+        "# TYPE tinysct_samples_total counter\n"
+        "tinysct_samples_total %llu\n"
+        "# HELP tinysct_usb_errors_total Failed measurements.\n"
+        "# TYPE tinysct_usb_errors_total counter\n"
+        "tinysct_usb_errors_total %lu\n"
+        "# HELP tinysct_reconnects_total Times the device was reopened after an error.\n"
+        "# TYPE tinysct_reconnects_total counter\n"
+        "tinysct_reconnects_total %lu\n",
+        r->cnt ? (double)r->accu / r->cnt : 0, (unsigned long)r->cnt, r->timeMs / 1000.0,
+        (unsigned long long)s.count, (unsigned long long)s.samples, (unsigned long)s.usbErrors, (unsigned long)s.gaps);
+    if((s.flags & TINYSCT_SHM_RMS) && len < size){
+        len += snprintf(text + len, size - len,
+            "# HELP tinysct_rms RMS of the ADC samples of the last interval.\n"
+            "# TYPE tinysct_rms gauge\n"
+            "tinysct_rms %.3f\n"
+            "# HELP tinysct_peak Largest absolute ADC sample of the last interval.\n"
+            "# TYPE tinysct_peak gauge\n"
+            "tinysct_peak %lu\n",
+            r->cnt ? sqrt((double)r->sq / r->cnt) : 0, (unsigned long)r->peak);
+    }
+    if((s.flags & TINYSCT_SHM_ENERGY) && len < size){
+        len += snprintf(text + len, size - len,
+            "# HELP tinysct_energy_averages_total Sum of the interval averages counted by the device since power-up.\n"
+            "# TYPE tinysct_energy_averages_total counter\n"
+            "tinysct_energy_averages_total %lu\n"
+            "# HELP tinysct_energy_intervals_total Intervals counted by the device since power-up.\n"
+            "# TYPE tinysct_energy_intervals_total counter\n"
+            "tinysct_energy_intervals_total %lu\n",
+            (unsigned long)s.energyAccu, (unsigned long)s.energyCnt);
+    }
+    return len < size ? len : size - 1;
+}
+
+static void *exporterMain(void *arg)
+{
+tinysctShm_t    *state = arg;
+struct timeval  timeout = {1, 0};
+char            request[1024], header[128], text[4096];
+int             client, n, len, textLen;
+
+    for(;;){
+        if((client = accept(exporterFd, NULL, NULL)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                usleep(EXPORTER_BACKOFF_MS * 1000);     /* out of descriptors or memory, may pass */
+                continue;
+            }
+            perror("exporter: accept");
+            break;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        len = 0;    /* read the request up to the empty line, its content does not matter */
+        while(len < (int)sizeof(request) - 1 && (n = read(client, request + len, sizeof(request) - 1 - len)) > 0){
+            len += n;
+            request[len] = 0;
+            if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+                break;
+        }
+        if((textLen = exporterFormat(state, text, sizeof(text))) < 0){
+            textLen = 0;
+            len = snprintf(header, sizeof(header), "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+        }else{
+            len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", textLen);
+        }
+        if(write(client, header, len) == len)
+            n = write(client, text, textLen);
+        close(client);
+    }
+    return NULL;
+}
+
+static int  exporterStart(char *address, tinysctShm_t *state)
+{
+pthread_t   thread;
+sigset_t    all, old;
+int         rval;
+
+    if((exporterFd = exporterListen(address)) < 0)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);   /* a scraper that goes away must not stop the daemon */
+    sigfillset(&all);           /* the signals are for the main thread */
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rval = pthread_create(&thread, NULL, exporterMain, state);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(rval != 0){
+        fprintf(stderr, "cannot start the exporter: %s\n", strerror(rval));
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* Keep the device open and measure in a loop, one interval every period ms
+ * (0: back to back). The start times are fixed in advance, so a slow request
+ * does not delay the following ones. Writes one line per interval: time
+ * (seconds since the epoch), sum of the ADC values, number of samples and
+ * average. When the device goes away (unplugged, hub reset, watchdog reset
+ * of the firmware) it is reopened as soon as libusb reports its arrival, or
+ * once per second without hot-plug support. The gap is marked with a line
+ * "# gap start end missed" (times of the failure and of the reconnection,
+ * number of missed periods, 0 with period 0) and the schedule continues on the same grid.
+ * SIGHUP reopens the output file (for log rotation), SIGINT and SIGTERM
+ * stop the daemon. With -m the readings are also published in a shared
+ * memory file, see tinysctshm.h, and with -e they are served to Prometheus.
+ * Both also get the RMS, peak and energy counters if the firmware has them.
+ * With -b the readings are also appended to a binary log, see logAppend(),
+ * and with -r summed up in rollups, see rollupAdd().
+ */
+static int  daemonMain(int argc, char **argv)
+{
+libusb_device_handle    *handle = NULL;
+libusb_hotplug_callback_handle  hotplug;
+FILE            *out = stdout;
+tinysctShm_t    *shm = NULL;
+logWriter_t     binaryLog;
+rollup_t        rollup;
+char            *fileName = argc > 3 ? argv[3] : NULL;
+double          period = argc > 2 ? atof(argv[2]) : 0, next, gapNext = 0, flushed;
+unsigned long   accu;
+unsigned int    cnt;
+struct timeval  tv, gapStart;
+tinysctReading_t    reading;
+record_t        rec;
+char            device[64];
+uint32_t        energy[2] = {0, 0};
+int             rval, fastRetries = 0, hasHotplug, gap = 0, extras = TINYSCT_SHM_RMS | TINYSCT_SHM_ENERGY, started = 0;
 
-static int usbOpenDevice(usb_dev_handle **device, int vendor, char *vendorName, int product, char *productName)
-{
-struct usb_bus      *bus;
-struct usb_device   *dev;
-usb_dev_handle      *handle = NULL;
-int                 errorCode = USB_ERROR_NOTFOUND;
-static int          didUsbInit = 0;
-
-    if(!didUsbInit){
-        didUsbInit = 1;
-        usb_init();
-    }
-    usb_find_busses();
-    usb_find_devices();
-    for(bus=usb_get_busses(); bus; bus=bus->next){
-        for(dev=bus->devices; dev; dev=dev->next){
-            if(dev->descriptor.idVendor == vendor && dev->descriptor.idProduct == product){
-                char    string[256];
-                int     len;
-                handle = usb_open(dev); /* we need to open the device in order to query strings */
-                if(!handle){
-                    errorCode = USB_ERROR_ACCESS;
-                    fprintf(stderr, "Warning: cannot open USB device: %s\n", usb_strerror());
-                    continue;
+    if(fileName != NULL && (out = fopen(fileName, "a")) == NULL){
+        perror(fileName);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, BUFSIZ);
+    if(shmFile != NULL){
+        if((shm = shmCreate(shmFile)) == NULL)
+            return 1;
+    }else if(exporterAddress != NULL){
+        if((shm = calloc(1, sizeof(*shm))) == NULL)  /* the same state, but private */
+            return 1;
+        shmInit(shm);
+    }
+    if(exporterAddress != NULL && exporterStart(exporterAddress, shm) != 0)
+        return 1;
+    if(binaryLogFile != NULL && logOpen(&binaryLog, binaryLogFile) != 0)
+        return 1;
+    if(rollupFile != NULL && rollupMap(&rollup, rollupFile, rollupSlots) != 0)
+        return 1;
+    signal(SIGINT, daemonSignal);
+    signal(SIGTERM, daemonSignal);
+    signal(SIGHUP, daemonSignal);
+    hasHotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+        && libusb_hotplug_register_callback(usbContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0,
+            USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, NULL, &hotplug) == 0;
+    next = flushed = monotonicMs();
+    while(!daemonStop){
+        if(handle == NULL){
+            if(hotplugArrived){
+                hotplugArrived = 0;
+                fastRetries = DAEMON_FAST_RETRIES;  /* it may take a moment until it can be opened */
+            }
+            if(usbOpenDevice(&handle, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct") != 0){
+                handle = NULL;
+                if(fastRetries > 0){
+                    fastRetries--;
+                    daemonWait(DAEMON_FAST_RETRY_MS);
+                }else{
+                    daemonWait(DAEMON_RETRY_MS);
                 }
-                if(vendorName == NULL && productName == NULL){  /* name does not matter */
-                    break;
+                continue;
+            }
+            fastRetries = 0;
+            usbDeviceName(handle, device, sizeof(device));
+            if(gap){
+                next = daemonSchedule(next, period);
+                gettimeofday(&tv, NULL);
+                gapWrite(out, device, (int64_t)gapStart.tv_sec * 1000 + gapStart.tv_usec / 1000, (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000,
+                    period > 0 ? (uint64_t)((next - gapNext) / period + 1.5) : 0);
+                fflush(out);
+                gap = 0;
+                if(shm != NULL){
+                    tinysctShmBegin(shm);
+                    shm->gaps++;
+                    tinysctShmEnd(shm);
                 }
-                /* now check whether the names match: */
-                len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    errorCode = USB_ERROR_IO;
-                    fprintf(stderr, "Warning: cannot query manufacturer for device: %s\n", usb_strerror());
-                }else{
-                    errorCode = USB_ERROR_NOTFOUND;
-                    /* fprintf(stderr, "seen device from vendor ->%s<-\n", string); */
-                    if(strcmp(string, vendorName) == 0){
-                        len = usbGetStringAscii(handle, dev->descriptor.iProduct, 0x0409, string, sizeof(string));
-                        if(len < 0){
-                            errorCode = USB_ERROR_IO;
-                            fprintf(stderr, "Warning: cannot query product for device: %s\n", usb_strerror());
-                        }else{
-                            errorCode = USB_ERROR_NOTFOUND;
-                            /* fprintf(stderr, "seen product ->%s<-\n", string); */
-                            if(strcmp(string, productName) == 0)
-                                break;
-                        }
-                    }
+            }
+        }
+        if(daemonReopen){
+            daemonReopen = 0;
+            if(fileName != NULL){
+                fclose(out);
+                if((out = fopen(fileName, "a")) == NULL){
+                    perror(fileName);
+                    return 1;
                 }
-                usb_close(handle);
-                handle = NULL;
+                setvbuf(out, NULL, _IOFBF, BUFSIZ);
+                started = 0;
+            }else{
+                fflush(out);
             }
+            if(binaryLogFile != NULL && logReopen(&binaryLog) != 0)
+                return 1;
         }
-        if(handle)
-            break;
+        while(next > monotonicMs() && !daemonStop){
+            hotplugArrived = 0;     /* only of interest while the device is away */
+            daemonWait(next - monotonicMs());
+        }
+        if(period > 0)
+            next = daemonSchedule(next + period, period);
+        memset(&reading, 0, sizeof(reading));
+        rval = measureOnce(handle, &accu, &cnt);
+        if(rval >= 0 && shm != NULL && extras != 0 && (rval = measureExtras(handle, extras, &reading, energy)) >= 0)
+            extras = rval;
+        if(rval < 0){
+            if(!daemonStop)
+                fprintf(stderr, "USB error: %s, reopening device\n", libusb_strerror(rval));
+            libusb_close(handle);
+            handle = NULL;
+            fflush(out);    /* the records before the gap */
+            gettimeofday(&gapStart, NULL);
+            gapNext = next;
+            gap = 1;
+            if(shm != NULL){
+                tinysctShmBegin(shm);
+                shm->usbErrors++;
+                tinysctShmEnd(shm);
+            }
+            continue;
+        }
+        gettimeofday(&tv, NULL);
+        reading.timeMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        reading.accu = accu;
+        reading.cnt = cnt;
+        rec.timeMs = reading.timeMs;
+        rec.device = device;
+        rec.accu = accu;
+        rec.cnt = cnt;
+        rec.hasRms = shm != NULL && (extras & TINYSCT_SHM_RMS);
+        rec.sq = reading.sq;
+        rec.peak = reading.peak;
+        recordWrite(out, &rec, &started);
+        if(daemonFlushDue(&flushed, next))
+            fflush(out);
+        if(shm != NULL)
+            shmPublish(shm, &reading, extras, energy);
+        if(binaryLogFile != NULL)
+            logAppend(&binaryLog, reading.timeMs, accu, cnt);
+        if(rollupFile != NULL && cnt != 0)
+            rollupAdd(&rollup, reading.timeMs, (double)accu / cnt);
+    }
+    if(binaryLogFile != NULL)
+        logClose(&binaryLog);
+    if(rollupFile != NULL)
+        munmap(rollup.header, rollup.size);
+    if(shmFile != NULL)
+        munmap(shm, sizeof(*shm));
+    if(hasHotplug)
+        libusb_hotplug_deregister_callback(usbContext, hotplug);
+    if(handle != NULL)
+        libusb_close(handle);
+    if(out != stdout)
+        fclose(out);
+    else
+        fflush(out);
+    return 0;
+}
+
+/* Like the daemon, but with all meters at the same time: CLICMD_MEASURE is
+ * sent to all devices together, one interval every period ms (0: back to
+ * back) on a schedule fixed in advance, and each device is told to wait for
+ * the time left until a common start, so the intervals of all meters line
+ * up. Each device has
+ * its own output, the file <name>.log in directory, or lines on stdout that
+ * start with the name. The name is the serial number (see usbDeviceName()).
+ * A device that fails is dropped; SIGHUP reopens the files.
+ */
+static int  pollAll(int argc, char **argv)
+{
+libusb_device_handle    *devices[MAX_DEVICES];
+controlRequest_t        requests[MAX_DEVICES];
+FILE                    *out[MAX_DEVICES];
+char                    names[MAX_DEVICES][64], fileName[512];
+char                    *directory = argc > 3 ? argv[3] : NULL;
+double                  period = argc > 2 ? atof(argv[2]) : 0, next, now, start, flushed;
+unsigned char           *data;
+record_t                rec;
+int                     started[MAX_DEVICES], stdoutStarted = 0;
+struct timeval          tv;
+int                     i, n, alive, delay, errorCode, pending = 0;
+
+    n = usbOpenDevices(devices, MAX_DEVICES, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct", NULL, &errorCode);
+    if(n == 0){
+        fprintf(stderr, "Could not find USB device \"tinysct\" with vid=0x%x pid=0x%x\n", USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT);
+        return 1;
     }
-    if(handle != NULL){
-        errorCode = 0;
-        *device = handle;
+    memset(requests, 0, sizeof(requests));
+    memset(started, 0, sizeof(started));
+    memset(&rec, 0, sizeof(rec));
+    for(i = 0; i < n; i++){
+        usbDeviceName(devices[i], names[i], sizeof(names[i]));
+        out[i] = stdout;
+        if(directory != NULL){
+            snprintf(fileName, sizeof(fileName), "%s/%s.log", directory, names[i]);
+            if((out[i] = fopen(fileName, "a")) == NULL){
+                perror(fileName);
+                return 1;
+            }
+            setvbuf(out[i], NULL, _IOFBF, BUFSIZ);
+        }
+        fprintf(stderr, "device %s\n", names[i]);
     }
-    return errorCode;
+    signal(SIGINT, daemonSignal);
+    signal(SIGTERM, daemonSignal);
+    signal(SIGHUP, daemonSignal);
+    alive = n;
+    next = flushed = monotonicMs();
+    while(!daemonStop && alive > 0){
+        if(daemonReopen && directory == NULL){
+            daemonReopen = 0;
+            fflush(stdout);
+        }else if(daemonReopen){
+            daemonReopen = 0;
+            for(i = 0; i < n; i++){
+                fclose(out[i]);
+                snprintf(fileName, sizeof(fileName), "%s/%s.log", directory, names[i]);
+                if((out[i] = fopen(fileName, "a")) == NULL){
+                    perror(fileName);
+                    return 1;
+                }
+                setvbuf(out[i], NULL, _IOFBF, BUFSIZ);
+                started[i] = 0;
+            }
+        }
+        now = monotonicMs();
+        if(next > now)
+            usleep((useconds_t)((next - now) * 1000));
+        if(period > 0)
+            next = daemonSchedule(next + period, period);   /* skips ahead on the grid if late */
+        start = monotonicMs() + RUNALL_MARGIN_MS;
+        for(i = 0; i < n; i++){
+            if(devices[i] == NULL)
+                continue;
+            if((delay = startDelay(start)) < 1){
+                fprintf(stderr, "%s: start time missed\n", names[i]);
+                delay = 1;
+            }
+            controlSubmit(&requests[i], devices[i], LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, CLICMD_MEASURE, delay, 0, &pending);
+        }
+        controlWait(&pending);
+        gettimeofday(&tv, NULL);
+        for(i = 0; i < n; i++){
+            if(devices[i] == NULL)
+                continue;
+            if(requests[i].result < 6){
+                if(requests[i].result < 0)
+                    fprintf(stderr, "%s: USB error: %s, device dropped\n", names[i], libusb_strerror(requests[i].result));
+                else
+                    fprintf(stderr, "%s: only %d bytes measure received (firmware without TINYSCT_CFG_MEASURE?)\n", names[i], requests[i].result);
+                libusb_close(devices[i]);
+                devices[i] = NULL;
+                fflush(out[i]);
+                alive--;
+                continue;
+            }
+            data = requests[i].data;
+            rec.timeMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+            rec.device = names[i];
+            rec.accu = data[0] + 256UL * data[1] + 65536UL * data[2] + 16777216UL * data[3];
+            rec.cnt = data[4] + 256 * data[5];
+            if(out[i] == stdout && outputFormat == FORMAT_TEXT)
+                printf("%s ", names[i]);    /* the other formats name the device */
+            recordWrite(out[i], &rec, out[i] == stdout ? &stdoutStarted : &started[i]);
+        }
+        if(daemonFlushDue(&flushed, next)){
+            for(i = 0; i < n; i++)
+                fflush(out[i]);
+        }
+    }
+    controlFree(requests, n);
+    for(i = 0; i < n; i++){
+        if(devices[i] != NULL)
+            libusb_close(devices[i]);
+        if(out[i] != stdout)
+            fclose(out[i]);
+    }
+    fflush(stdout);
+    return alive == 0;
 }
 
 
-int main(int argc, char **argv)
+static int usbMain(int argc, char **argv)
 {
-usb_dev_handle      *handle = NULL;
+libusb_device_handle      *handle = NULL;
 unsigned char       buffer[30];
 int                 nBytes;
 
-    if(argc < 2){
-        usage(argv[0]);
+    if(!usbInit()){
+        fprintf(stderr, "Could not initialise libusb\n");
         exit(1);
     }
-    usb_init();
+    if(strcmp(argv[1], "runall") == 0){
+        libusb_device_handle  *devices[MAX_DEVICES];
+        int             i, n, errorCode;
+
+        n = usbOpenDevices(devices, MAX_DEVICES, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct", selectSerial, &errorCode);
+        if(n == 0){
+            fprintf(stderr, "Could not find USB device \"tinysct\" with vid=0x%x pid=0x%x\n", USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT);
+            exit(1);
+        }
+        errorCode = runAll(devices, n);
+        for(i = 0; i < n; i++)
+            libusb_close(devices[i]);
+        return errorCode;
+    }
+    if(strcmp(argv[1], "daemon") == 0)
+        return daemonMain(argc, argv);
+    if(strcmp(argv[1], "pollall") == 0)
+        return pollAll(argc, argv);
+    if(strcmp(argv[1], "openbench") == 0)
+        return openBench(argc > 2 ? atoi(argv[2]) : 20);
     if(usbOpenDevice(&handle, USBDEV_SHARED_VENDOR, "up.nl.eu.org", USBDEV_SHARED_PRODUCT, "tinysct") != 0){
         fprintf(stderr, "Could not find USB device \"tinysct\" with vid=0x%x pid=0x%x\n", USBDEV_SHARED_VENDOR, USBDEV_SHARED_PRODUCT);
         exit(1);
@@ -167,10 +2146,10 @@ int                 nBytes;
  */
         for(i=0;i<1000;i++){
             v = rand() & 0xffff;
-            nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_ECHO, v, 0, (char *)buffer, sizeof(buffer), 5000);
+            nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_ECHO, v, 0, buffer, sizeof(buffer), 5000);
             if(nBytes < 2){
                 if(nBytes < 0)
-                    fprintf(stderr, "USB error: %s\n", usb_strerror());
+                    fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
                 fprintf(stderr, "only %d bytes received in iteration %d\n", nBytes, i);
                 fprintf(stderr, "value sent = 0x%x\n", v);
                 exit(1);
@@ -183,48 +2162,403 @@ int                 nBytes;
         }
         printf("communication test succeeded\n");
     }else if(strcmp(argv[1], "getosccal") == 0){
-        nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_GETOSC, 0, 0, (char *)buffer, sizeof(buffer), 5000);
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETOSC, 0, 0, buffer, sizeof(buffer), 5000);
         if(nBytes < 2){
             if(nBytes < 0)
-                fprintf(stderr, "USB error: %s\n", usb_strerror());
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
             fprintf(stderr, "only %d bytes getosccal received\n", nBytes);
             exit(1);
         }
 	printf("pre-programmed OSCCAL: %d   current OSCCAL: %d\n", buffer[0], buffer[1]);
     }else if(strcmp(argv[1], "runadc") == 0){
-        nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_RUNADC, 0, 0, (char *)buffer, sizeof(buffer), 5000);
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_RUNADC, argc > 2 ? atoi(argv[2]) : 0, 0, buffer, sizeof(buffer), 5000);
         if(nBytes < 0){
-            fprintf(stderr, "USB error: %s\n", usb_strerror());
+            fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            exit(1);
+        }
+    }else if(strcmp(argv[1], "measure") == 0){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_MEASURE, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 6){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes measure received\n", nBytes);
             exit(1);
         }
+        if(outputFormat == FORMAT_TEXT){
+            printf("%lu %d\n", buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3], buffer[4] + 256 * buffer[5]);
+        }else{
+            record_t        rec;
+            struct timeval  tv;
+            char            name[64];
+            int             started = 0;
+
+            gettimeofday(&tv, NULL);
+            memset(&rec, 0, sizeof(rec));
+            rec.timeMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+            rec.device = usbDeviceName(handle, name, sizeof(name));
+            rec.accu = buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3];
+            rec.cnt = buffer[4] + 256 * buffer[5];
+            recordWrite(stdout, &rec, &started);
+        }
     }else if(strcmp(argv[1], "getadc") == 0){
-        nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_GETADC, 0, 0, (char *)buffer, sizeof(buffer), 5000);
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETADC, 0, 0, buffer, sizeof(buffer), 5000);
         if(nBytes < 2){
             if(nBytes < 0)
-                fprintf(stderr, "USB error: %s\n", usb_strerror());
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
             fprintf(stderr, "only %d bytes from ADC received\n", nBytes);
             exit(1);
         }
 	printf("%d\n", buffer[0] + 256 * buffer[1]);
     }else if(strcmp(argv[1], "getacc") == 0){
-        nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_GETACC, 0, 0, (char *)buffer, sizeof(buffer), 5000);
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETACC, 0, 0, buffer, sizeof(buffer), 5000);
         if(nBytes < 3){
             if(nBytes < 0)
-                fprintf(stderr, "USB error: %s\n", usb_strerror());
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
             fprintf(stderr, "only %d bytes from ADC received\n", nBytes);
             exit(1);
         }
 	printf("%d\n", buffer[0] + 256 * buffer[1] + 65536 * buffer[2]);
     }else if(strcmp(argv[1], "getcnt") == 0){
-        nBytes = usb_control_msg(handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, CLICMD_GETCNT, 0, 0, (char *)buffer, sizeof(buffer), 5000);
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCNT, 0, 0, buffer, sizeof(buffer), 5000);
         if(nBytes < 2){
             if(nBytes < 0)
-                fprintf(stderr, "USB error: %s\n", usb_strerror());
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
             fprintf(stderr, "only %d bytes from ADC received\n", nBytes);
             exit(1);
         }
 	printf("%d\n", buffer[0] + 256 * buffer[1]);
+    }else if(strcmp(argv[1], "getrms") == 0){
+        unsigned long   sq;
+        int             cnt;
+
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETRMS, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 8){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getrms received (firmware without TINYSCT_CFG_RMS/PEAK?)\n", nBytes);
+            exit(1);
+        }
+        sq = buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3];
+        cnt = buffer[4] + 256 * buffer[5];
+	printf("%.2f %d\n", cnt ? sqrt((double)sq / cnt) : 0, buffer[6] + 256 * buffer[7]);
+    }else if(strcmp(argv[1], "getcap") == 0){
+        unsigned char   samples[128];
+        int             i, n = 0, value;
+
+        do{
+            nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCAP, 0, n, samples, sizeof(samples), 5000);
+            if(nBytes < 0){
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+                exit(1);
+            }
+            for(i = 0; i + 1 < nBytes; i += 2){
+                value = (samples[i] + 256 * samples[i + 1]) & 0x3ff;
+                printf("%d\n", value >= 512 ? value - 1024 : value);  /* 10 bit two's complement */
+            }
+            n += nBytes / 2;
+        }while(nBytes == sizeof(samples));
+    }else if(strcmp(argv[1], "gethist") == 0){
+        static const int    lower[HIST_BINS + 1] = {0, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 513};
+        unsigned char   hist[2 * HIST_BINS];
+        unsigned int    count[HIST_BINS], total = 0;
+        int             i;
+
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETHIST, 0, 0, hist, sizeof(hist), 5000);
+        if(nBytes < (int)sizeof(hist)){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes gethist received (measurement running or firmware without TINYSCT_CFG_HISTOGRAM?)\n", nBytes);
+            exit(1);
+        }
+        for(i = 0; i < HIST_BINS; i++){
+            count[i] = hist[2 * i] + 256 * hist[2 * i + 1];
+            total += count[i];
+        }
+        for(i = 0; i < HIST_BINS; i++)   /* lower and upper bound of the absolute ADC value, count, percentage */
+            printf("%3d %3d %5u %5.1f\n", lower[i], lower[i + 1] - 1, count[i], total ? 100.0 * count[i] / total : 0);
+    }else if(strcmp(argv[1], "getreset") == 0){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETRST, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 3){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getreset received\n", nBytes);
+            exit(1);
+        }
+	printf("cause:%s%s%s%s%s   warm resets: %d\n",
+	    buffer[0] & 0x01 ? " power-on" : "",
+	    buffer[0] & 0x02 ? " external" : "",
+	    buffer[0] & 0x04 ? " brown-out" : "",
+	    buffer[0] & 0x08 ? " watchdog" : "",
+	    buffer[0] & 0x80 ? " (state restored)" : "",
+	    buffer[1] + 256 * buffer[2]);
+    }else if(strcmp(argv[1], "getenergy") == 0){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETNRG, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 6){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getenergy received\n", nBytes);
+            exit(1);
+        }
+	printf("%lu %d\n", buffer[0] + 256UL * buffer[1] + 65536UL * buffer[2] + 16777216UL * buffer[3], buffer[4] + 256 * buffer[5]);
+    }else if(strcmp(argv[1], "getperf") == 0){
+        int reset = argc > 2 && strcmp(argv[2], "reset") == 0;
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETPERF, reset, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 7){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getperf received\n", nBytes);
+            exit(1);
+        }
+	printf("loop avg: %.1f us   loop max: %.1f us%s\n", (buffer[0] + 256 * buffer[1]) / 256.0 * PERF_TICK_US, buffer[4] * PERF_TICK_US, buffer[4] == 255 ? " (or more)" : "");
+	printf("late conversions: %d\n", buffer[2] + 256 * buffer[3]);
+	printf("usbPoll max: %.1f us   usbFunctionSetup max: %.1f us\n", buffer[5] * PERF_TICK_US, buffer[6] * PERF_TICK_US);
+    }else if(strcmp(argv[1], "getconfig") == 0){
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCFG, 0, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 4){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getconfig received\n", nBytes);
+            exit(1);
+        }
+	printf("interval: %.1f ms (%d ticks)   mode: %s   gain: %s   version: %d%s\n",
+	    buffer[0] * INTERVAL_TICK_MS, buffer[0],
+	    buffer[1] & CONFIG_CONTINUOUS ? "continuous" : "single",
+	    buffer[1] & CONFIG_GAIN20 ? "20x" : "1x",
+	    buffer[2], buffer[3] ? "   (stored in EEPROM)" : "");
+    }else if(strcmp(argv[1], "getlog") == 0){
+        unsigned char   info[7], cfg[4], entries[8];
+        int             i, k, count, newest, perEntry, sinceEntry, first = 0;
+        double          intervalMs;
+
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_LOGINFO, 0, 0, info, sizeof(info), 5000);
+        if(nBytes < (int)sizeof(info)){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes loginfo received (firmware without TINYSCT_CFG_LOG_DEPTH?)\n", nBytes);
+            exit(1);
+        }
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCFG, 0, 0, cfg, sizeof(cfg), 5000);
+        if(nBytes < (int)sizeof(cfg)){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes getconfig received\n", nBytes);
+            exit(1);
+        }
+        count = info[0];
+        newest = info[1];
+        perEntry = info[3] + 256 * info[4];
+        sinceEntry = info[5] + 256 * info[6];
+        intervalMs = cfg[0] * INTERVAL_TICK_MS;
+        if(argc > 2){   /* only the entries after the one with this sequence number */
+            k = (newest - atoi(argv[2])) & 0xff;
+            if(k < count)
+                first = count - k;
+        }
+        /* The entries are in the order they were logged; the newest ended
+         * sinceEntry intervals ago. One line per entry: sequence number,
+         * seconds since the end of the entry, average ADC result.
+         */
+        for(i = first; i < count; i += 4){
+            nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETLOG, 0, i, entries, sizeof(entries), 5000);
+            if(nBytes < 0){
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+                exit(1);
+            }
+            for(k = 0; k + 1 < nBytes && i + k / 2 < count; k += 2){
+                int n = count - 1 - (i + k / 2);   /* entries logged after this one */
+                printf("%d %.0f %.2f\n", (newest - n) & 0xff,
+                    (sinceEntry + (double)n * perEntry) * intervalMs / 1000, (entries[k] + 256 * entries[k + 1]) / 64.0);
+            }
+            if(nBytes < (int)sizeof(entries))
+                break;
+        }
+        if(!(cfg[1] & CONFIG_CONTINUOUS))
+            fprintf(stderr, "note: the device is not in continuous mode and does not log\n");
+    }else if(strcmp(argv[1], "cycles") == 0){
+        unsigned char   cycle[5];
+        int             count = argc > 2 ? atoi(argv[2]) : 0, printed = 0, newest, want = -1, back, cnt;
+        unsigned long   sum;
+
+        /* Poll the newest cycle and fetch the ones completed since the last
+         * poll from the device's buffer. One line per cycle: cycle number
+         * (0..255), number of samples, average ADC result.
+         */
+        while(count == 0 || printed < count){
+            nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCYCLE, 0, 0, cycle, sizeof(cycle), 5000);
+            if(nBytes < (int)sizeof(cycle)){
+                if(nBytes < 0)
+                    fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+                fprintf(stderr, "only %d bytes getcycle received (firmware without TINYSCT_CFG_CYCLE_DEPTH?)\n", nBytes);
+                exit(1);
+            }
+            newest = cycle[0];
+            if(want < 0)
+                want = newest;  /* start with the newest cycle */
+            while(((newest - want + 1) & 0xff) != 0 && (count == 0 || printed < count)){
+                back = (newest - want) & 0xff;
+                if(back > 0){
+                    nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCYCLE, 0, back, cycle, sizeof(cycle), 5000);
+                    if(nBytes < (int)sizeof(cycle)){    /* no longer in the buffer */
+                        printf("# %d cycles missed\n", back);
+                        want = newest;
+                        continue;
+                    }
+                    if(cycle[0] != want)    /* a cycle completed meanwhile, poll again */
+                        break;
+                }else{
+                    nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_GETCYCLE, 0, 0, cycle, sizeof(cycle), 5000);
+                    if(nBytes < (int)sizeof(cycle) || cycle[0] != want)
+                        break;
+                }
+                sum = cycle[1] + 256UL * cycle[2] + 65536UL * cycle[3];
+                cnt = cycle[4];
+                if(cnt > 0){
+                    printf("%d %d %.2f\n", want, cnt, (double)sum / cnt);
+                    fflush(stdout);
+                    printed++;
+                }
+                want = (want + 1) & 0xff;
+            }
+            usleep(5000);
+        }
+    }else if(strcmp(argv[1], "serial") == 0){
+        int serial = argc > 2 ? (int)strtol(argv[2], NULL, 16) : 0;
+
+        if(argc > 2 && (serial < 0 || serial >= 0xffff)){
+            fprintf(stderr, "serial number must be between 0000 and FFFE\n");
+            exit(1);
+        }
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_SETSERIAL, serial, argc > 2, buffer, sizeof(buffer), 5000);
+        if(nBytes < 2){
+            if(nBytes < 0)
+                fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            fprintf(stderr, "only %d bytes serial received (firmware without TINYSCT_CFG_SERIAL?)\n", nBytes);
+            exit(1);
+        }
+        printf("%04X%s\n", buffer[0] + 256 * buffer[1], argc > 2 ? "   (stored in EEPROM)" : "");
+    }else if(strcmp(argv[1], "setconfig") == 0){
+        int i, ticks, flags = 0;
+
+        if(argc < 3){
+            usage(argv[0]);
+            exit(1);
+        }
+        ticks = (int)(atof(argv[2]) / INTERVAL_TICK_MS + 0.5);
+        if(ticks < 1 || ticks > 255){
+            fprintf(stderr, "interval must be between 1 and %.0f ms\n", 255 * INTERVAL_TICK_MS);
+            exit(1);
+        }
+        for(i = 3; i < argc; i++){
+            if(strcmp(argv[i], "continuous") == 0){
+                flags |= CONFIG_CONTINUOUS;
+            }else if(strcmp(argv[i], "gain20") == 0){
+                flags |= CONFIG_GAIN20;
+            }else{
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+        nBytes = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN, CLICMD_SETCFG, ticks | flags << 8, 0, buffer, sizeof(buffer), 5000);
+        if(nBytes < 0){
+            fprintf(stderr, "USB error: %s\n", libusb_strerror(nBytes));
+            exit(1);
+        }
     }
-    usb_close(handle);
+    libusb_close(handle);
     return 0;
 }
+#endif /* NO_LIBUSB */
+
+
+int main(int argc, char **argv)
+{
+    /* options, see usage() */
+    while(argc > 2 && argv[1][0] == '-' && argv[1][1] != 0 && (argv[1][2] == 0 || strcmp(argv[1], "--format") == 0)){
+        if(strcmp(argv[1], "--") == 0){ /* end of the options */
+            argv[1] = argv[0];
+            argc--;
+            argv++;
+            break;
+        }
+        if(strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "--format") == 0){
+            if(formatParse(argv[2]) < 0){
+                usage(argv[0]);
+                exit(1);
+            }
+        }else
+#ifndef NO_LIBUSB
+        if(argv[1][1] == 'p'){
+            selectPath = argv[2];
+        }else if(argv[1][1] == 's'){
+            selectSerial = argv[2];
+        }else if(argv[1][1] == 'c'){
+            cacheFile = argv[2];
+        }else if(argv[1][1] == 'm'){
+            shmFile = argv[2];
+        }else if(argv[1][1] == 'e'){
+            exporterAddress = argv[2];
+        }else if(argv[1][1] == 'b'){
+            binaryLogFile = argv[2];
+        }else if(argv[1][1] == 'r'){
+            rollupFile = argv[2];
+        }else if(argv[1][1] == 'R'){
+            if(sscanf(argv[2], "%u,%u,%u", &rollupSlots[0], &rollupSlots[1], &rollupSlots[2]) != 3
+                || rollupSlots[0] == 0 || rollupSlots[1] == 0 || rollupSlots[2] == 0){
+                usage(argv[0]);
+                exit(1);
+            }
+        }else
+#endif
+        {
+            usage(argv[0]);
+            exit(1);
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc < 2){
+        usage(argv[0]);
+        exit(1);
+    }
+    if(outputFormat != FORMAT_TEXT && !formatCommand(argv[1], argc > 2 ? argv[2] : NULL)){
+        fprintf(stderr, "-f is only supported by measure, runall, daemon, pollall, dump, shmread and /dev/hidrawN read\n");
+        exit(1);
+    }
+#ifdef HAVE_HIDRAW
+    if(strncmp(argv[1], "/dev/", 5) == 0){
+        if(argc < 3){
+            usage(argv[0]);
+            exit(1);
+        }
+        return hidrawMain(argv[1], argv[2]);
+    }
+#endif
+    if(strcmp(argv[1], "shmread") == 0){
+        if(argc < 3){
+            usage(argv[0]);
+            exit(1);
+        }
+        return shmReadMain(argv[2], argc > 3 ? atoi(argv[3]) : 1);
+    }
+    if(strcmp(argv[1], "dump") == 0 || strcmp(argv[1], "query") == 0){
+        if(argc < 3){
+            usage(argv[0]);
+            exit(1);
+        }
+        return logMain(argc, argv);
+    }
+    if(strcmp(argv[1], "rollup") == 0){
+        if(argc < 3){
+            usage(argv[0]);
+            exit(1);
+        }
+        return rollupMain(argc, argv);
+    }
+#ifndef NO_LIBUSB
+    return usbMain(argc, argv);
+#else
+    usage(argv[0]);
+    return 1;
+#endif
+}
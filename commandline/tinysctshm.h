@@ -0,0 +1,142 @@
+/* Name: tinysctshm.h
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+#ifndef __tinysctshm_h_included__
+#define __tinysctshm_h_included__
+
+/*
+General Description:
+Layout of the file in which "tinysct -m file daemon" publishes its readings,
+for programs which want the latest reading without talking to the device.
+A consumer maps the file once with mmap(PROT_READ, MAP_SHARED) and then
+reads it without any system call:
+
+    tinysctShm_t        *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    tinysctReading_t    r;
+
+    if(shm->magic == TINYSCT_SHM_MAGIC && shm->version == TINYSCT_SHM_VERSION
+        && tinysctShmLatest(shm, &r) > 0)
+        ... use r ...
+
+The daemon is the only writer. It protects the data with a sequence lock:
+the sequence number is odd while an update is in progress, and a reader
+retries if it was odd or changed while the reader copied the data. Readers
+never block the writer, and the writer never blocks a reader for long: if
+the sequence number stays odd (the daemon died during an update), the read
+functions give up after about TINYSCT_SHM_TRIES * 100 us and return -1.
+The functions below use the GCC atomic builtins.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TINYSCT_SHM_MAGIC   0x68537374  /* "tsSh" in a little endian file */
+#define TINYSCT_SHM_VERSION 2
+#define TINYSCT_SHM_HISTORY 64          /* readings in the ring */
+#define TINYSCT_SHM_TRIES   1000        /* reads before a reader gives up, 100 us apart */
+
+typedef struct tinysctReading{
+    int64_t     timeMs;     /* end of the interval, ms since the epoch */
+    uint32_t    accu;       /* sum of the absolute ADC values */
+    uint32_t    cnt;        /* number of samples */
+    uint32_t    sq;         /* sum of the squared samples, see TINYSCT_SHM_RMS */
+    uint32_t    peak;       /* largest absolute sample, see TINYSCT_SHM_RMS */
+}tinysctReading_t;
+
+#define TINYSCT_SHM_RMS     0x01    /* the firmware reports sq and peak (TINYSCT_CFG_RMS, TINYSCT_CFG_PEAK) */
+#define TINYSCT_SHM_ENERGY  0x02    /* the firmware reports its energy counters (TINYSCT_CFG_ENERGY) */
+
+typedef struct tinysctShm{
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            seq;        /* sequence lock, odd during an update */
+    uint32_t            pid;        /* process id of the daemon */
+    uint64_t            count;      /* readings published */
+    uint64_t            samples;    /* sum of cnt of all readings */
+    uint32_t            usbErrors;  /* failed measurements */
+    uint32_t            gaps;       /* reconnections of the device */
+    uint32_t            flags;      /* TINYSCT_SHM_RMS, TINYSCT_SHM_ENERGY */
+    uint32_t            energyAccu; /* CLICMD_GETNRG: sum of the interval averages */
+    uint32_t            energyCnt;  /* CLICMD_GETNRG: number of intervals */
+    uint32_t            reserved;
+    tinysctReading_t    latest;
+    tinysctReading_t    history[TINYSCT_SHM_HISTORY];   /* reading n is history[n % TINYSCT_SHM_HISTORY] */
+}tinysctShm_t;
+
+/* Writer side, used by the daemon. */
+static inline void  tinysctShmBegin(tinysctShm_t *shm)
+{
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void  tinysctShmEnd(tinysctShm_t *shm)
+{
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Wait before the next try of a read. Returns 0 once the reader should give
+ * up.
+ */
+static inline int   tinysctShmRetry(int *tries)
+{
+struct timespec ts = {0, 100000};
+
+    if(++*tries >= TINYSCT_SHM_TRIES)
+        return 0;
+    nanosleep(&ts, NULL);
+    return 1;
+}
+
+/* Copy the whole shared state to copy, consistently. Returns 0, or -1 if
+ * the writer did not finish its update (see above).
+ */
+static inline int   tinysctShmCopy(const tinysctShm_t *shm, tinysctShm_t *copy)
+{
+uint32_t    seq;
+int         tries = 0;
+
+    for(;;){
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if(!(seq & 1)){
+            memcpy(copy, shm, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+                return 0;
+        }
+        if(!tinysctShmRetry(&tries))
+            return -1;
+    }
+}
+
+/* Copy the latest reading to reading. Returns the number of readings
+ * published so far, 0 if there is none yet, or -1 if the writer did not
+ * finish its update.
+ */
+static inline int64_t   tinysctShmLatest(const tinysctShm_t *shm, tinysctReading_t *reading)
+{
+uint32_t    seq;
+uint64_t    count;
+int         tries = 0;
+
+    for(;;){
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if(!(seq & 1)){
+            memcpy(reading, &shm->latest, sizeof(*reading));
+            count = shm->count;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+                return (int64_t)count;
+        }
+        if(!tinysctShmRetry(&tries))
+            return -1;
+    }
+}
+
+#endif /* __tinysctshm_h_included__ */
@@ -11,10 +11,15 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "usbdrv.h"
 #include "oddebug.h"
+#include "tinysctconfig.h"
+#include "measure.h"
 
 /* interface with usb_control_msg for CLI */
 #define CLICMD_ECHO   0
@@ -23,10 +28,22 @@
 #define CLICMD_GETADC 7
 #define CLICMD_GETACC 8
 #define CLICMD_GETCNT 9
+#define CLICMD_GETRST 10
+#define CLICMD_GETNRG 11
+#define CLICMD_GETPERF 12
+#define CLICMD_MEASURE 13
+#define CLICMD_GETRMS 14
+#define CLICMD_GETCAP 15
+#define CLICMD_GETHIST 16
+#define CLICMD_GETCFG 17
+#define CLICMD_SETCFG 18
+#define CLICMD_LOGINFO 19
+#define CLICMD_GETLOG 20
+#define CLICMD_GETCYCLE 21
+#define CLICMD_SETSERIAL 22
 
-#define STATE_WAIT 0
-#define STATE_SEND_KEY 1
-#define STATE_RELEASE_KEY 2
+/* interface with HID feature reports for hidraw, first byte of the report */
+#define HIDCMD_RUNADC 1
 
 #define UTIL_BIN4(x)        (uchar)((0##x & 01000)/64 + (0##x & 0100)/16 + (0##x & 010)/4 + (0##x & 1))
 #define UTIL_BIN8(hi, lo)   (uchar)(UTIL_BIN4(hi) * 16 + UTIL_BIN4(lo))
@@ -37,105 +54,577 @@
 
 /* ------------------------------------------------------------------------- */
 
-static uchar    reportBuffer[2];    /* buffer for HID reports */
+static uchar    reportBuffer[8];    /* buffer for HID reports */
 static uchar    idleRate;           /* in 4 ms units */
-static uchar    intervalRunning, adcPending, defOSCCAL, state = STATE_WAIT;
-unsigned int    adcCnt;
-static unsigned long     adcAccu;
+static uchar    intervalRunning, adcPending, defOSCCAL, reportPending;
+static uchar    resetCause;         /* MCUSR at boot, bit 7 set if state was restored */
+static uchar    skipCalibration;
+static measure_t    window;         /* interval in progress */
+#if TINYSCT_CFG_HPF_SHIFT
+static long         hpfState;       /* DC component of the input, kept across intervals */
+#endif
+#if TINYSCT_CFG_CAPTURE_DEPTH
+static unsigned int capture[TINYSCT_CFG_CAPTURE_DEPTH];    /* raw ADC values, start of interval */
+#endif
+
+/* Operating mode, set with CLICMD_SETCFG. With TINYSCT_CFG_EEPROM it is kept
+ * in EEPROM, protected by a version and a CRC, and loaded at boot so the
+ * meter starts in the configured mode without the host. The compile time
+ * settings are the defaults for an erased or invalid EEPROM.
+ */
+#define CONFIG_VERSION      1
+#define CONFIG_CONTINUOUS   0x01    /* start at power-up and sample without gaps */
+#define CONFIG_GAIN20       0x02    /* differential input gain 20x instead of 1x */
+#define CONFIG_FLAGS        (CONFIG_CONTINUOUS | CONFIG_GAIN20)
+
+typedef struct config{
+    uchar           version;
+    uchar           intervalTicks;  /* length of the interval in Timer1 ticks */
+    uchar           flags;
+    uchar           crc;
+}config_t;
+
+static config_t     config;
+static uchar        configLoaded;   /* config was read from EEPROM */
+#if TINYSCT_CFG_EEPROM
+static config_t     eeConfig EEMEM;
+static uchar        configWrite = sizeof(config_t);  /* next byte to write to EEPROM */
+#endif
+
+/* Log of coarse averages for standalone operation. In continuous mode the
+ * averages of LOG_INTERVALS intervals are summed up and their mean is stored
+ * in a ring buffer in EEPROM, in units of 1/64 ADC count. The host downloads
+ * the backlog whenever it is running. The position of the newest entry is
+ * not stored (that would wear out a single EEPROM cell), it is found at boot
+ * from the sequence numbers of the entries. Each cell is written once per
+ * TINYSCT_CFG_LOG_DEPTH entries.
+ */
+#if TINYSCT_CFG_LOG_DEPTH
+#if !TINYSCT_CFG_EEPROM
+#error "TINYSCT_CFG_LOG_DEPTH requires TINYSCT_CFG_EEPROM"
+#endif
+#if TINYSCT_CFG_LOG_DEPTH > 255
+#error "TINYSCT_CFG_LOG_DEPTH must be less than 256"
+#endif
+#define LOG_INTERVALS   TINYSCT_CFG_LOG_INTERVALS
+#define LOG_ERASED      0xffff      /* average of an erased entry */
+
+typedef struct logEntry{
+    uchar           seq;            /* sequence number, consecutive, written last */
+    unsigned int    average;        /* 1/64 ADC count */
+}logEntry_t;
+
+static logEntry_t   eeLog[TINYSCT_CFG_LOG_DEPTH] EEMEM;
+static logEntry_t   logEntry;       /* entry being written */
+static uchar        logWrite = sizeof(logEntry_t);  /* next byte to write to EEPROM */
+static uchar        logHead;        /* index of the next entry */
+static uchar        logCount;       /* valid entries */
+#endif
+
+/* The results of the last interval read as 0 while an interval is running,
+ * except in continuous mode where an interval is always running.
+ */
+#define RESULT_BUSY         (intervalRunning && !(config.flags & CONFIG_CONTINUOUS))
+
+/* Measurement state that survives a watchdog or brown-out reset. It lives in
+ * .noinit so the C startup code does not clear it and is protected by a
+ * checksum which is only updated outside of a running interval. A power-on
+ * reset or a checksum mismatch starts from scratch.
+ */
+#define PERSIST_MAGIC   0x5a
+#define RESET_WARM      0x80
+
+typedef struct persist{
+    measure_t       last;           /* result of the last completed interval */
+#if TINYSCT_CFG_ENERGY
+    unsigned long   energyAccu;     /* sum of the averages of all intervals */
+#endif
+    unsigned int    windowCnt;      /* number of completed intervals */
+#if TINYSCT_CFG_LOG_DEPTH
+    unsigned long   logSum;         /* sum of the averages for the next log entry */
+    unsigned int    logCnt;         /* number of intervals in logSum */
+#endif
+    unsigned int    resetCnt;       /* warm resets since power-on */
+    uchar           osccal;         /* calibrated OSCCAL */
+    uchar           checksum;
+}persist_t;
+
+#if TINYSCT_CFG_WARM_RESTART
+static persist_t    persist __attribute__((section(".noinit")));
+#else
+static persist_t    persist;
+#endif
+
+/* Hot path instrumentation. All times are in Timer0 ticks of 64 CPU cycles
+ * (3.9 us); Timer0 runs freely and wraps after 256 ticks. A main loop
+ * iteration of more than 255 ticks is recorded as 255. A conversion counts
+ * as late when it is read more than PERF_LATE_TICKS after it was started,
+ * i.e. more than one conversion time (13 ADC clocks = 26 ticks) after it
+ * completed.
+ */
+#if TINYSCT_CFG_PERF
+#define PERF_LATE_TICKS 52
+
+typedef struct perf{
+    unsigned int    loopAvg;        /* moving average, 8.8 fixed point */
+    unsigned int    lateCnt;        /* conversions read late */
+    uchar           loopMax;
+    uchar           pollMax;        /* usbPoll() incl. interrupts */
+    uchar           setupMax;       /* usbFunctionSetup() */
+}perf_t;
+
+static perf_t   perf;
+static uchar    adcStartTick;
+static uchar    perfSkip;       /* CLICMD_MEASURE ran in this loop iteration */
+#endif
 
 
 /* ------------------------------------------------------------------------- */
 
 const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = { /* USB report descriptor */
-    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
-    0x09, 0x06,                    // USAGE (Keyboard)
+    0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
+    0x09, 0x01,                    // USAGE (Vendor Usage 1)
     0xa1, 0x01,                    // COLLECTION (Application)
-    0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
-    0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
-    0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
     0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
-    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
-    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
     0x95, 0x08,                    //   REPORT_COUNT (8)
+    0x09, 0x00,                    //   USAGE (Undefined)
     0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x25, 0x65,                    //   LOGICAL_MAXIMUM (101)
-    0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
-    0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)
-    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
     0xc0                           // END_COLLECTION
 };
-/* We use a simplifed keyboard report descriptor which does not support the
- * boot protocol. We don't allow setting status LEDs and we only allow one
- * simultaneous key press (except modifiers). We can therefore use short
- * 2 byte input reports.
- * The report descriptor has been created with usb.org's "HID Descriptor Tool"
- * which can be downloaded from http://www.usb.org/developers/hidpage/.
- * Redundant entries (such as LOGICAL_MINIMUM and USAGE_PAGE) have been omitted
- * for the second INPUT item.
+/* A vendor defined report descriptor without report IDs. The input report
+ * and the feature report both carry the 8 byte measurement record built by
+ * buildReport(), so the host can use /dev/hidrawN instead of libusb: read()
+ * blocks until the next interval completes and HIDIOCGFEATURE returns the
+ * last result at any time. Writing a feature report with HIDCMD_RUNADC in
+ * the first byte starts an interval, optionally delayed by the number of ms
+ * in the second byte.
+ *
+ * Record layout (little endian):
+ *   0..3  sum of the absolute ADC values of the last completed interval
+ *   4..5  number of samples of the last completed interval
+ *   6     interval sequence number (low byte of the energy window count)
+ *   7     bit 0: interval running, the result is the previous one (never
+ *         set in continuous mode), bit 7: state restored after a warm reset
  */
 
-/* Keyboard usage values, see usb.org's HID-usage-tables document, chapter
- * 10 Keyboard/Keypad Page for more codes.
- */
-#define MOD_CONTROL_LEFT    (1<<0)
-#define MOD_SHIFT_LEFT      (1<<1)
-#define MOD_ALT_LEFT        (1<<2)
-#define MOD_GUI_LEFT        (1<<3)
-#define MOD_CONTROL_RIGHT   (1<<4)
-#define MOD_SHIFT_RIGHT     (1<<5)
-#define MOD_ALT_RIGHT       (1<<6)
-#define MOD_GUI_RIGHT       (1<<7)
+/* ------------------------------------------------------------------------- */
+
+static void buildReport(void)
+{
+uchar   *p = (uchar *)&persist.last;        /* accu and cnt, little endian */
+uchar   i;
 
-#define KEY_OKAY      0x4B
+    for(i = 0; i < 6; i++)
+        reportBuffer[i] = *p++;
+    reportBuffer[6] = persist.windowCnt;
+    reportBuffer[7] = RESULT_BUSY | (resetCause & RESET_WARM);
+}
 
 /* ------------------------------------------------------------------------- */
 
-static void buildReport(void)
+#if TINYSCT_CFG_WARM_RESTART
+static uchar persistChecksum(void)
 {
-    reportBuffer[0] = 0;    /* no modifiers */
-    if(state == STATE_SEND_KEY)
-        reportBuffer[1] = KEY_OKAY;
-    else
-        reportBuffer[1] = 0;
+uchar   *p = (uchar *)&persist;
+uchar   i, sum = PERSIST_MAGIC;
+
+    for(i = 0; i < sizeof(persist) - 1; i++)
+        sum += *p++;
+    return sum;
 }
 
+static void persistSave(void)
+{
+    persist.checksum = persistChecksum();
+}
+#else
+#define persistSave()
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#if TINYSCT_CFG_PERF
+static void perfInit(void)
+{
+    TCCR0A = 0;          /* normal mode */
+    TCCR0B = 0x03;       /* select clock: 16.5M/64 -> 3.9 us per tick */
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 
+static void adcSelectGain(void)
+{
+    if(config.flags & CONFIG_GAIN20)
+        ADMUX = 0b10000111;  /* Vref=1.1V internal reference, measure ADC2-ADC3, gain=20x */
+    else
+        ADMUX = 0b10000110;  /* Vref=1.1V internal reference, measure ADC2-ADC3, gain=1x */
+}
+
 static void adcInit(void)
 {
-    ADMUX = 0b10000110;  /* Vref=1.1V internal reference, measure ADC2-ADC3, gain=1x */
+    adcSelectGain();
     ADCSRA = 0b00000111; /* disable auto trigger, disable interrupt, rate = 1/128 */
     ADCSRB = 0b10000000; /* enable BIN: Bipolar Input Mode */
 }
 
 /* ------------------------------------------------------------------------- */
 
-static void startTimer(void)
+/* Results per mains cycle, for consumers which need to see a load change
+ * before the interval is complete. A cycle ends when the signal goes from
+ * below -CYCLE_HYSTERESIS to positive, or after 255 samples if there is no
+ * such zero crossing (no load). The last TINYSCT_CFG_CYCLE_DEPTH cycles are
+ * kept, each as the sum of the absolute values (bits 0..23) and the number
+ * of samples (bits 24..31).
+ */
+#if TINYSCT_CFG_CYCLE_DEPTH
+#if TINYSCT_CFG_CYCLE_DEPTH & (TINYSCT_CFG_CYCLE_DEPTH - 1)
+#error "TINYSCT_CFG_CYCLE_DEPTH must be a power of 2"
+#endif
+#define CYCLE_HYSTERESIS    4
+
+static unsigned long    cycleLog[TINYSCT_CFG_CYCLE_DEPTH];
+static unsigned long    cycleAccu;
+static uchar            cycleCnt, cycleArmed;
+static uchar            cycleSeq;       /* number of completed cycles, modulo 256 */
+
+static void cycleClear(void)
+{
+    cycleAccu = 0;
+    cycleCnt = 0;
+    cycleArmed = 0;
+}
+
+static void cycleAdd(unsigned int value, uchar negative)
+{
+    if((cycleArmed && !negative) || cycleCnt == 255){   /* this sample starts the next cycle */
+        cycleLog[cycleSeq & (TINYSCT_CFG_CYCLE_DEPTH - 1)] = cycleAccu | (unsigned long)cycleCnt << 24;
+        cycleSeq++;
+        cycleClear();
+    }
+    if(negative && value > CYCLE_HYSTERESIS)
+        cycleArmed = 1;
+    cycleAccu += value;
+    cycleCnt++;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+/* An interval can be scheduled to start up to 200 Timer1 ticks in the future.
+ * A tick of 16384 cycles is 0.993 ms, so with OSCCAL calibrated to the USB
+ * frame length the delay is counted in (almost) frames. This allows the host
+ * to start several meters within the same frame even though their requests
+ * arrive in different frames.
+ */
+#define INTERVAL_SAMPLING   1
+#define INTERVAL_SCHEDULED  2
+#define INTERVAL_MAX_DELAY  200
+
+/* Default length of the interval in Timer1 ticks, 201 (200 ms) for 10
+ * cycles @ 50 Hz. The length in use is config.intervalTicks.
+ */
+#define INTERVAL_TICKS      ((F_CPU / TINYSCT_CFG_MAINS_HZ * TINYSCT_CFG_CYCLES + 8192) / 16384)
+#if INTERVAL_TICKS > 255
+#error "TINYSCT_CFG_CYCLES is too large for TINYSCT_CFG_MAINS_HZ"
+#endif
+
+static void startTimer(uchar delay)
 {
     if(intervalRunning == 0){
+	GTCCR = (1 << PSR1);     /* reset prescaler, the first tick is a full one */
 	TCCR1 = 0x0f;    /* select clock: 16.5M/16384 -> overflow occurs after 254 ms */
-	TCNT1 = 55;      /* to achieve overflow in 200 ms i.e. approx. 10 waves @ 50 Hz */
 	if(TIFR & (1 << TOV1))
 	    TIFR = (1 << TOV1);  /* clear overflow */
-	intervalRunning = 1;
-	ADCSRA |= (1 << ADEN);   /* enable ADC */
 	adcPending = 0;
-	adcCnt = 0;
-	adcAccu = 0;
+	measureClear(&window);
+#if TINYSCT_CFG_CYCLE_DEPTH
+	cycleClear();            /* the partial cycle is from a previous interval */
+#endif
+	if(delay){
+	    if(delay > INTERVAL_MAX_DELAY)
+		delay = INTERVAL_MAX_DELAY;
+	    TCNT1 = 256 - delay;
+	    intervalRunning = INTERVAL_SCHEDULED;
+	}else{
+	    TCNT1 = 256 - config.intervalTicks;  /* to achieve overflow in 200 ms i.e. approx. 10 waves @ 50 Hz */
+	    intervalRunning = INTERVAL_SAMPLING;
+	    ADCSRA |= (1 << ADEN);   /* enable ADC */
+	}
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static uchar configCrc(void)
+{
+uchar   *p = (uchar *)&config;
+uchar   i, crc = 0;
+
+    for(i = 0; i < sizeof(config) - 1; i++)
+        crc = _crc8_ccitt_update(crc, *p++);
+    return crc;
+}
+
+static void configLoad(void)
+{
+#if TINYSCT_CFG_EEPROM
+    eeprom_read_block(&config, &eeConfig, sizeof(config));
+    if(config.version == CONFIG_VERSION && config.crc == configCrc() && config.intervalTicks != 0){
+        configLoaded = 1;
+        return;
     }
+#endif
+    config.version = CONFIG_VERSION;
+    config.intervalTicks = INTERVAL_TICKS;
+    config.flags = TINYSCT_CFG_CONTINUOUS ? CONFIG_CONTINUOUS : 0;
+    config.crc = configCrc();
 }
 
 /* ------------------------------------------------------------------------- */
 
+/* Serial number string descriptor, 4 hex digits of a 16 bit number in
+ * EEPROM, so the host can tell meters with the shared VID/PID apart. An
+ * erased EEPROM gets a number made up at the first boot, see serialRandom();
+ * CLICMD_SETSERIAL sets a number of the user's choice. The host sees a new
+ * number after the next USB reset.
+ */
+#if TINYSCT_CFG_SERIAL
+#if !TINYSCT_CFG_EEPROM
+#error "TINYSCT_CFG_SERIAL requires TINYSCT_CFG_EEPROM"
+#endif
+#define SERIAL_DIGITS       4       /* see USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER */
+#define SERIAL_ERASED       0xffff
+
+int                 usbDescriptorStringSerialNumber[] = {
+    USB_STRING_DESCRIPTOR_HEADER(SERIAL_DIGITS), '0', '0', '0', '0'
+};
+static unsigned int serial;
+static unsigned int eeSerial EEMEM;
+static uchar        serialWrite = sizeof(serial);   /* next byte to write to EEPROM */
+
+static void serialFormat(void)
+{
+uchar   i, digit;
+
+    for(i = 0; i < SERIAL_DIGITS; i++){
+        digit = (serial >> (4 * (SERIAL_DIGITS - 1 - i))) & 0xf;
+        usbDescriptorStringSerialNumber[1 + i] = digit < 10 ? '0' + digit : 'A' - 10 + digit;
+    }
+}
+
+/* Called before adcInit(), the ADC is free. The noise of the ADC alone is
+ * not enough: with a quiet or shorted input every meter would read the same
+ * samples. So the number also depends on what differs from chip to chip: the
+ * factory OSCCAL value and the power-up contents of the SRAM that is not
+ * used yet, between the variables and the stack.
+ */
+static unsigned int serialRandom(void)
+{
+extern uchar    __heap_start;
+unsigned int    crc = 0xffff;
+uchar           i, *p;
+
+    crc = _crc16_update(crc, defOSCCAL);
+    for(p = &__heap_start; p < (uchar *)SP - 16; p++)   /* stay clear of our own stack frame */
+        crc = _crc16_update(crc, *p);
+    ADMUX = 0b10000111;     /* ADC2-ADC3 at gain 20x, the low bits are noise */
+    ADCSRB = 0b10000000;
+    for(i = 0; i < 64; i++){
+        ADCSRA = 0b11000111;    /* enable, start conversion, rate = 1/128 */
+        while(ADCSRA & (1 << ADSC))
+            ;
+        crc = _crc16_update(crc, ADCL);
+        crc = _crc16_update(crc, ADCH);
+    }
+    ADCSRA = 0b00000111;
+    return crc;
+}
+
+static void serialLoad(void)
+{
+    eeprom_read_block(&serial, &eeSerial, sizeof(serial));
+    if(serial == SERIAL_ERASED){
+        serial = serialRandom();
+        if(serial == SERIAL_ERASED)
+            serial--;
+        serialWrite = 0;    /* written by eepromPoll() */
+    }
+    serialFormat();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#if TINYSCT_CFG_LOG_DEPTH
+static void logLoad(void)
+{
+logEntry_t  prev, e;
+uchar       i;
+
+    eeprom_read_block(&prev, &eeLog[0], sizeof(prev));
+    if(prev.average == LOG_ERASED){
+        logEntry.seq = 0xff;    /* the first entry gets 0 */
+        return;
+    }
+    e = prev;
+    for(i = 1; i < TINYSCT_CFG_LOG_DEPTH; i++){
+        eeprom_read_block(&e, &eeLog[i], sizeof(e));
+        if(e.average == LOG_ERASED || e.seq != (uchar)(prev.seq + 1))
+            break;
+        prev = e;
+    }
+    logEntry.seq = prev.seq;    /* newest */
+    logHead = i < TINYSCT_CFG_LOG_DEPTH ? i : 0;
+    logCount = e.average == LOG_ERASED ? i : TINYSCT_CFG_LOG_DEPTH;
+}
+
+/* Called for every completed interval in continuous mode. */
+static void logAdd(unsigned int average)
+{
+    persist.logSum += average;
+    if(++persist.logCnt >= LOG_INTERVALS){
+        logEntry.seq++;
+        logEntry.average = (persist.logSum * 64 + LOG_INTERVALS / 2) / LOG_INTERVALS;
+        logWrite = 0;       /* written by eepromPoll() */
+        persist.logSum = 0;
+        persist.logCnt = 0;
+    }
+}
+#endif
+
+/* Writes the configuration, the serial number and the log to EEPROM one byte
+ * per call, without waiting for the EEPROM: a byte takes 3.4 ms to write,
+ * much longer than the sample loop may be blocked.
+ */
+#if TINYSCT_CFG_EEPROM
+static void eepromPoll(void)
+{
+#if TINYSCT_CFG_LOG_DEPTH
+uchar   i;
+#endif
+
+    if(!eeprom_is_ready())
+        return;
+    if(configWrite < sizeof(config)){
+        eeprom_update_byte((uchar *)&eeConfig + configWrite, ((uchar *)&config)[configWrite]);
+        configWrite++;
+        if(configWrite == sizeof(config))
+            configLoaded = 1;
+        return;
+    }
+#if TINYSCT_CFG_SERIAL
+    if(serialWrite < sizeof(serial)){
+        eeprom_update_byte((uchar *)&eeSerial + serialWrite, ((uchar *)&serial)[serialWrite]);
+        serialWrite++;
+        return;
+    }
+#endif
+#if TINYSCT_CFG_LOG_DEPTH
+    if(logWrite < sizeof(logEntry)){
+        /* The average first, seq (byte 0) last: after a power loss during
+         * the write the slot keeps its old sequence number, which breaks the
+         * chain, so logLoad() drops the torn entry.
+         */
+        i = logWrite + 1 < sizeof(logEntry) ? logWrite + 1 : 0;
+        eeprom_update_byte((uchar *)&eeLog[logHead] + i, ((uchar *)&logEntry)[i]);
+        logWrite++;
+        if(logWrite == sizeof(logEntry)){   /* the entry is visible to the host when complete */
+            if(++logHead >= TINYSCT_CFG_LOG_DEPTH)
+                logHead = 0;
+            if(logCount < TINYSCT_CFG_LOG_DEPTH)
+                logCount++;
+        }
+    }
+#endif
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
 static void timerPoll(void)
 {
     if(TIFR & (1 << TOV1)){
         TIFR = (1 << TOV1);      /* clear overflow */
-	intervalRunning = 0;
-	ADCSRA &= ~(1 << ADEN);  /* disable ADC */
-	TCCR1 = 0x00;            /* stop timer/counter1 */
+	if(intervalRunning == INTERVAL_SCHEDULED){
+	    TCNT1 = 256 - config.intervalTicks;  /* start of the 200 ms interval */
+	    intervalRunning = INTERVAL_SAMPLING;
+	    ADCSRA |= (1 << ADEN);   /* enable ADC */
+	    return;
+	}
+	if(config.flags & CONFIG_CONTINUOUS){
+	    TCNT1 = 256 - config.intervalTicks;  /* next interval starts right away */
+	}else{
+	    intervalRunning = 0;
+	    ADCSRA &= ~(1 << ADEN);  /* disable ADC */
+	    TCCR1 = 0x00;            /* stop timer/counter1 */
+	}
+	adcSelectGain();         /* a new configuration applies from the next interval */
+	persist.last = window;
+	if(config.flags & CONFIG_CONTINUOUS)
+	    measureClear(&window);   /* a conversion still pending belongs to the next interval */
+	persist.windowCnt++;
+#if TINYSCT_CFG_ENERGY
+	persist.energyAccu += measureAverage(&persist.last);
+#endif
+#if TINYSCT_CFG_LOG_DEPTH
+	if(config.flags & CONFIG_CONTINUOUS)
+	    logAdd(measureAverage(&persist.last));
+#endif
+	persistSave();
+	reportPending = 1;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void adcPoll(void)
+{
+uchar            adcLo, adcHi, negative;
+unsigned int     value;
+#if TINYSCT_CFG_HPF_SHIFT
+int              filtered;
+#endif
+
+    if(intervalRunning == INTERVAL_SAMPLING){
+        if(adcPending == 0){
+            adcPending = 1;
+            ADCSRA |= (1 << ADSC);  /* start next conversion */
+#if TINYSCT_CFG_PERF
+            adcStartTick = TCNT0;
+#endif
+        }
+        if(adcPending && !(ADCSRA & (1 << ADSC))){
+            adcPending = 0;
+#if TINYSCT_CFG_PERF
+            if((uchar)(TCNT0 - adcStartTick) > PERF_LATE_TICKS)
+                perf.lateCnt++;
+#endif
+            adcLo = ADCL;   /* ADCL must be read first */
+            adcHi = ADCH;
+#if TINYSCT_CFG_CAPTURE_DEPTH
+            if(window.cnt < TINYSCT_CFG_CAPTURE_DEPTH)
+                capture[window.cnt] = (adcHi << 8) | adcLo;
+#endif
+#if TINYSCT_CFG_HPF_SHIFT
+            filtered = measureHighPass(&hpfState, measureSigned(adcLo, adcHi), TINYSCT_CFG_HPF_SHIFT);
+            negative = filtered < 0;
+            value = negative ? -filtered : filtered;
+#else
+            negative = adcHi > 1;
+            value = measureFold(adcLo, adcHi);
+#endif
+            measureAdd(&window, value);
+#if TINYSCT_CFG_CYCLE_DEPTH
+            cycleAdd(value, negative);
+#else
+            (void)negative;
+#endif
+        }
     }
 }
 
@@ -143,21 +632,26 @@ static void timerPoll(void)
 /* ------------------------ interface to USB driver ------------------------ */
 /* ------------------------------------------------------------------------- */
 
-uchar	usbFunctionSetup(uchar data[8])
+#if TINYSCT_CFG_PERF
+static uchar   functionSetup(uchar data[8])
+#else
+uchar   usbFunctionSetup(uchar data[8])
+#endif
 {
 usbRequest_t    *rq = (void *)data;
-static uchar            replyBuf[3];
+static uchar            replyBuf[8];
 static unsigned int     adcResult;
 
 
     if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS){    /* class request type */
         switch(rq->bRequest) {
-        case USBRQ_HID_GET_REPORT: // send "no keys pressed" if asked here
+        case USBRQ_HID_GET_REPORT: // send the measurement record, input or feature
             // wValue: ReportType (highbyte), ReportID (lowbyte)
             usbMsgPtr = reportBuffer;
-            reportBuffer[0] = 0;
-            reportBuffer[1] = 0;
+            buildReport();
             return sizeof(reportBuffer);
+        case USBRQ_HID_SET_REPORT: // receive a command in usbFunctionWrite()
+            return USB_NO_MSG;
         case USBRQ_HID_GET_IDLE: // send idle rate to PC as required by spec
             usbMsgPtr = &idleRate;
             return 1;
@@ -177,48 +671,240 @@ static unsigned int     adcResult;
             replyBuf[0] = defOSCCAL;
             replyBuf[1] = OSCCAL;
             return 2;
-        case CLICMD_RUNADC:  /* no response expected */
-	    startTimer();
+        case CLICMD_RUNADC:  /* no response expected, wValue = delay in ms */
+	    startTimer(rq->wValue.bytes[1] ? INTERVAL_MAX_DELAY : rq->wValue.bytes[0]);
             return 0;
         case CLICMD_GETADC:  /* result = 2 bytes */
             usbMsgPtr = replyBuf;
-	    if(intervalRunning | (adcCnt == 0)){
+	    if(RESULT_BUSY | (persist.last.cnt == 0)){
                 replyBuf[0] = 0;
                 replyBuf[1] = 0;
             }else{
-		adcResult = (float)adcAccu / adcCnt + 0.5;  /* average voltage = peak voltage * 2/π */
+		adcResult = measureAverage(&persist.last);  /* average voltage = peak voltage * 2/π */
                 replyBuf[0] = adcResult & 255; /* low byte */
                 replyBuf[1] = adcResult >> 8;  /* high byte */
             }
             return 2;
         case CLICMD_GETACC:  /* result = 3 bytes */
             usbMsgPtr = replyBuf;
-	    if(intervalRunning){
+	    if(RESULT_BUSY){
                 replyBuf[0] = 0;
                 replyBuf[1] = 0;
                 replyBuf[2] = 0;
             }else{
-                replyBuf[0] = adcAccu & 255;    /* low byte */
-		adcResult = adcAccu >> 8;
+                replyBuf[0] = persist.last.accu & 255;    /* low byte */
+		adcResult = persist.last.accu >> 8;
                 replyBuf[1] = adcResult & 255;    /* second byte */
                 replyBuf[2] = adcResult >> 8;     /* high byte */
             }
             return 3;
         case CLICMD_GETCNT:  /* result = 2 bytes */
             usbMsgPtr = replyBuf;
-	    if(intervalRunning){
+	    if(RESULT_BUSY){
                 replyBuf[0] = 0;
                 replyBuf[1] = 0;
             }else{
-                replyBuf[0] = adcCnt & 255; /* low byte */
-                replyBuf[1] = adcCnt >> 8;  /* high byte */
+                replyBuf[0] = persist.last.cnt & 255; /* low byte */
+                replyBuf[1] = persist.last.cnt >> 8;  /* high byte */
+            }
+            return 2;
+        case CLICMD_GETRST:  /* result = 3 bytes */
+            usbMsgPtr = replyBuf;
+            replyBuf[0] = resetCause;
+            replyBuf[1] = persist.resetCnt & 255; /* low byte */
+            replyBuf[2] = persist.resetCnt >> 8;  /* high byte */
+            return 3;
+#if TINYSCT_CFG_ENERGY
+        case CLICMD_GETNRG:  /* result = 6 bytes */
+            usbMsgPtr = (uchar *)&persist.energyAccu;  /* energyAccu and windowCnt are adjacent, little endian */
+            return 6;
+#endif
+#if TINYSCT_CFG_MEASURE
+        case CLICMD_MEASURE:  /* result = 6 bytes, sent when the interval is complete */
+            /* Sample right here instead of in the main loop. The driver
+             * NAKs the host's IN tokens until we return, so the host gets
+             * the result in a single control transfer as soon as it exists.
+             * timerPoll() sets reportPending when an interval completes.
+             * usbPoll() does not run meanwhile, see TINYSCT_CFG_MEASURE;
+             * the EEPROM writes go on.
+             */
+            startTimer(rq->wValue.bytes[1] ? INTERVAL_MAX_DELAY : rq->wValue.bytes[0]);
+            reportPending = 0;
+            while(!reportPending){
+                wdt_reset();
+                timerPoll();
+                adcPoll();
+#if TINYSCT_CFG_EEPROM
+                eepromPoll();
+#endif
+            }
+#if TINYSCT_CFG_PERF
+            perfSkip = 1;   /* the stall is not a loop or usbPoll() time */
+#endif
+            usbMsgPtr = (uchar *)&persist.last;  /* accu and cnt, little endian */
+            return 6;
+#endif
+#if TINYSCT_CFG_RMS || TINYSCT_CFG_PEAK
+        case CLICMD_GETRMS:  /* result = 8 bytes: sum of squares, count, peak */
+            usbMsgPtr = replyBuf;
+            {
+                uchar   i;
+                for(i = 0; i < 8; i++)
+                    replyBuf[i] = 0;
+            }
+            if(!RESULT_BUSY){
+#if TINYSCT_CFG_RMS
+                *(unsigned long *)&replyBuf[0] = persist.last.sqAccu;
+#endif
+                *(unsigned int *)&replyBuf[4] = persist.last.cnt;
+#if TINYSCT_CFG_PEAK
+                *(unsigned int *)&replyBuf[6] = persist.last.peak;
+#endif
+            }
+            return 8;
+#endif
+#if TINYSCT_CFG_CAPTURE_DEPTH
+        case CLICMD_GETCAP:  /* result = raw samples from wIndex on, 2 bytes each, as many as fit in wLength */
+            {
+                unsigned int    n = rq->wIndex.word;
+                /* In continuous mode the next interval overwrites the capture
+                 * while the host reads it, and it would not belong to the
+                 * interval the other results are from.
+                 */
+                if(config.flags & CONFIG_CONTINUOUS)
+                    return 0;
+                if(RESULT_BUSY || n >= TINYSCT_CFG_CAPTURE_DEPTH || n >= persist.last.cnt)
+                    return 0;
+                usbMsgPtr = (uchar *)&capture[n];
+                n = persist.last.cnt - n;   /* samples left */
+                if(n > TINYSCT_CFG_CAPTURE_DEPTH - rq->wIndex.word)
+                    n = TINYSCT_CFG_CAPTURE_DEPTH - rq->wIndex.word;
+                if(n > 127)
+                    n = 127;
+                n *= 2;
+                if(rq->wLength.word < n)
+                    n = rq->wLength.word;
+                return n;
             }
+#endif
+#if TINYSCT_CFG_HISTOGRAM
+        case CLICMD_GETHIST:  /* result = 16 bins, 2 bytes each, see measure.h */
+            if(RESULT_BUSY)
+                return 0;
+            usbMsgPtr = (uchar *)persist.last.hist;
+            return sizeof(persist.last.hist);
+#endif
+        case CLICMD_GETCFG:  /* result = 4 bytes: interval ticks, flags, version, stored in EEPROM */
+            usbMsgPtr = replyBuf;
+            replyBuf[0] = config.intervalTicks;
+            replyBuf[1] = config.flags;
+            replyBuf[2] = config.version;
+            replyBuf[3] = configLoaded;
+            return 4;
+        case CLICMD_SETCFG:  /* no response expected, wValue = interval ticks (low byte), flags (high byte) */
+            config.intervalTicks = rq->wValue.bytes[0] ? rq->wValue.bytes[0] : INTERVAL_TICKS;
+            config.flags = rq->wValue.bytes[1] & CONFIG_FLAGS;
+            config.crc = configCrc();
+            configLoaded = 0;
+#if TINYSCT_CFG_EEPROM
+            configWrite = 0;    /* written by eepromPoll() */
+#endif
+            if(intervalRunning == 0){
+                adcSelectGain();
+                if(config.flags & CONFIG_CONTINUOUS)
+                    startTimer(0);
+            }
+            return 0;
+#if TINYSCT_CFG_LOG_DEPTH
+        case CLICMD_LOGINFO:  /* result = 7 bytes: entries, newest seq, depth, intervals per entry, intervals so far */
+            usbMsgPtr = replyBuf;
+            replyBuf[0] = logCount;
+            replyBuf[1] = logEntry.seq - (logWrite < sizeof(logEntry));   /* entry being written is not valid yet */
+            replyBuf[2] = TINYSCT_CFG_LOG_DEPTH;
+            replyBuf[3] = LOG_INTERVALS & 255;
+            replyBuf[4] = LOG_INTERVALS >> 8;
+            replyBuf[5] = persist.logCnt & 255;
+            replyBuf[6] = persist.logCnt >> 8;
+            return 7;
+        case CLICMD_GETLOG:  /* result = up to 4 averages, 2 bytes each, wIndex = first entry, 0 is the oldest */
+            usbMsgPtr = replyBuf;
+            {
+                uchar           i, n = 0;
+                unsigned int    index;
+                if(rq->wIndex.word >= logCount)
+                    return 0;
+                index = logHead + TINYSCT_CFG_LOG_DEPTH - logCount + rq->wIndex.bytes[0];
+                if(index >= TINYSCT_CFG_LOG_DEPTH)  /* less than twice the depth */
+                    index -= TINYSCT_CFG_LOG_DEPTH;
+                for(i = rq->wIndex.bytes[0]; i < logCount && n < 8; i++){
+                    eeprom_read_block(&replyBuf[n], &eeLog[index].average, 2);
+                    n += 2;
+                    if(++index >= TINYSCT_CFG_LOG_DEPTH)
+                        index = 0;
+                }
+                return n;
+            }
+#endif
+#if TINYSCT_CFG_CYCLE_DEPTH
+        case CLICMD_GETCYCLE:  /* result = 5 bytes: cycle number, sum (3 bytes), samples; wIndex = cycles back from the newest */
+            /* One cycle per request, copied so that it cannot change while it is sent. */
+            if(rq->wIndex.word >= TINYSCT_CFG_CYCLE_DEPTH)
+                return 0;
+            usbMsgPtr = replyBuf;
+            replyBuf[0] = cycleSeq - 1 - rq->wIndex.bytes[0];
+            *(unsigned long *)&replyBuf[1] = cycleLog[replyBuf[0] & (TINYSCT_CFG_CYCLE_DEPTH - 1)];
+            return 5;
+#endif
+#if TINYSCT_CFG_SERIAL
+        case CLICMD_SETSERIAL:  /* result = 2 bytes: serial number; wIndex = 1: set it to wValue */
+            if(rq->wIndex.bytes[0] == 1 && rq->wValue.word != SERIAL_ERASED){
+                serial = rq->wValue.word;
+                serialFormat();
+                serialWrite = 0;    /* written by eepromPoll() */
+            }
+            usbMsgPtr = replyBuf;
+            *(unsigned int *)replyBuf = serial;
             return 2;
+#endif
+#if TINYSCT_CFG_PERF
+        case CLICMD_GETPERF:  /* result = 7 bytes, wValue = 1 resets the counters */
+            usbMsgPtr = replyBuf;
+            {
+                uchar   *p = (uchar *)&perf, i;
+                for(i = 0; i < sizeof(perf); i++){
+                    replyBuf[i] = *p;
+                    if(rq->wValue.bytes[0])
+                        *p = 0;
+                    p++;
+                }
+            }
+            return sizeof(perf);
+#endif
         }
     }
     return 0;
 }
 
+uchar   usbFunctionWrite(uchar *data, uchar len)
+{
+    if(len > 0 && data[0] == HIDCMD_RUNADC)
+        startTimer(len > 1 ? data[1] : 0);  /* second byte = delay in ms */
+    return 1;   /* the remainder of the report is ignored */
+}
+
+#if TINYSCT_CFG_PERF
+uchar	usbFunctionSetup(uchar data[8])
+{
+uchar   start = TCNT0, len;
+
+    len = functionSetup(data);
+    start = TCNT0 - start;
+    if(start > perf.setupMax && data[1] != CLICMD_MEASURE)  /* bRequest, MEASURE waits for the interval */
+        perf.setupMax = start;
+    return len;
+}
+#endif
+
 
 /* ------------------------------------------------------------------------- */
 /* ------------------------ Oscillator Calibration ------------------------- */
@@ -274,7 +960,15 @@ void    usbEventResetReady(void)
      * usbMeasureFrameLength() counts CPU cycles.
      */
     cli();
-    calibrateOscillator();
+    if(skipCalibration){
+        skipCalibration = 0;    /* OSCCAL was restored after a warm reset */
+    }else{
+        calibrateOscillator();
+#if TINYSCT_CFG_WARM_RESTART
+        persist.osccal = OSCCAL;
+        persistSave();
+#endif
+    }
     sei();
 }
 
@@ -284,61 +978,105 @@ void    usbEventResetReady(void)
 
 int main(void)
 {
-uchar            i, adcHi, adcLo;
-unsigned int     adcValue;
+uchar            i;
+#if TINYSCT_CFG_PERF
+uchar            now, loopStart = 0;
+#endif
 
+    resetCause = MCUSR;
+    MCUSR = 0;
+    wdt_disable();  /* the watchdog stays enabled after a watchdog reset */
     defOSCCAL=OSCCAL;
 
     /* calibration value OSCCAL is fine tuned after USB reset. Refer to Oscillator Calibration above */
 
+#if TINYSCT_CFG_WARM_RESTART
+    if(!(resetCause & (1 << PORF)) && persist.checksum == persistChecksum()){
+        /* warm reset: keep results and energy counters, restore OSCCAL and
+         * only disconnect long enough for the host to notice */
+        resetCause |= RESET_WARM;
+        persist.resetCnt++;
+        OSCCAL = persist.osccal;
+        skipCalibration = 1;
+        i = 19;
+    }else{
+        measureClear(&persist.last);
+#if TINYSCT_CFG_ENERGY
+        persist.energyAccu = 0;
+#endif
+        persist.windowCnt = 0;
+#if TINYSCT_CFG_LOG_DEPTH
+        persist.logSum = 0;
+        persist.logCnt = 0;
+#endif
+        persist.resetCnt = 0;
+        persist.osccal = OSCCAL;
+        i = 0;
+    }
+    persistSave();
+#else
+    i = 0;
+#endif
+
     odDebugInit();
     usbDeviceDisconnect();
-    for(i=0;i<20;i++){  /* 300 ms disconnect */
+    for(;i<20;i++){  /* 300 ms disconnect, 15 ms after a warm reset */
         _delay_ms(15);
     }
     usbDeviceConnect();
+    wdt_enable(WDTO_1S);
+#if TINYSCT_CFG_PERF
+    perfInit();
+#endif
+    configLoad();
+#if TINYSCT_CFG_SERIAL
+    serialLoad();
+#endif
+#if TINYSCT_CFG_LOG_DEPTH
+    logLoad();
+#endif
     adcInit();
+    if(config.flags & CONFIG_CONTINUOUS)
+        startTimer(0);  /* sample from power-up, before the host has enumerated us */
     usbInit();
     sei();
     for(;;){    /* main event loop */
+#if TINYSCT_CFG_PERF
+        now = TCNT0;
+        i = now - loopStart;
+        if((TIFR & (1 << TOV0)) && now >= loopStart)
+            i = 255;            /* timer wrapped and went past the start */
+        TIFR = (1 << TOV0);
+        loopStart = now;
+        if(perfSkip){
+            perfSkip = 0;
+        }else{
+            if(i > perf.loopMax)
+                perf.loopMax = i;
+            perf.loopAvg += (int)(((unsigned int)i << 8) - perf.loopAvg) >> 4;
+        }
+#endif
 
+        wdt_reset();
         timerPoll();
 
-	if(intervalRunning){
-	    if(adcPending == 0){
-		adcPending = 1;
-		ADCSRA |= (1 << ADSC);  /* start next conversion */
-	    }
-	    if(adcPending && !(ADCSRA & (1 << ADSC))){
-		adcPending = 0;
-		adcLo = ADCL;
-		adcHi = ADCH;
-		if(adcHi > 1){
-		    /* result is negative so clear sign in ADC9 and process two's complement value */
-		    adcHi -= 2;
-		    adcValue = 512 - (256 * adcHi + adcLo);
-		}else
-		    adcValue = 256 * adcHi + adcLo;
-		adcAccu += adcValue;
-		adcCnt++;
-	    }
-	}
+        adcPoll();
+#if TINYSCT_CFG_EEPROM
+        eepromPoll();
+#endif
 
+#if TINYSCT_CFG_PERF
+        now = TCNT0;
         usbPoll();
-        if(usbInterruptIsReady() && state != STATE_WAIT){
-            switch(state) {
-            case STATE_SEND_KEY:
-                buildReport();
-                state = STATE_RELEASE_KEY; // release next
-                break;
-            case STATE_RELEASE_KEY:
-                buildReport();
-                state = STATE_WAIT; // go back to waiting
-                break;
-            default:
-                state = STATE_WAIT; // should not happen
-            }
-            // start sending
+        now = TCNT0 - now;
+        if(now > perf.pollMax && !perfSkip)
+            perf.pollMax = now;
+#else
+        usbPoll();
+#endif
+        if(usbInterruptIsReady() && reportPending){
+            reportPending = 0;
+            buildReport();
             usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
         }
     }
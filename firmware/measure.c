@@ -0,0 +1,17 @@
+/* Name: measure.c
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+#include "measure.h"
+
+unsigned int measureAverage(const measure_t *m)
+{
+    if(m->cnt == 0)
+        return 0;
+    return (m->accu + m->cnt / 2) / m->cnt;
+}
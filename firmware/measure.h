@@ -0,0 +1,137 @@
+/* Name: measure.h
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+/*
+General Description:
+The measurement core of the firmware: folding the signed result of the
+bipolar ADC into its absolute value, accumulating it over an interval and
+averaging. It uses no AVR specific code so it can be compiled by avr-gcc for
+the firmware and by the host compiler for benchmarks. The functions used per
+sample are inline so the sample loop does not pay for a call.
+*/
+
+#ifndef __measure_h_included__
+#define __measure_h_included__
+
+#include "tinysctconfig.h"
+
+/* Histogram bins of the absolute values 0..512, two per octave:
+ *   bin    0: 0..3 (noise)
+ *   bins 1..14: 4..5, 6..7, 8..11, 12..15, ... 256..383, 384..511
+ *   bin   15: 512 (full scale, the input is clipped)
+ */
+#define MEASURE_BINS    16
+
+typedef struct measure{
+    unsigned long   accu;   /* sum of the absolute ADC values */
+    unsigned int    cnt;    /* number of samples */
+#if TINYSCT_CFG_RMS
+    unsigned long   sqAccu; /* sum of the squares */
+#endif
+#if TINYSCT_CFG_PEAK
+    unsigned int    peak;   /* largest absolute value */
+#endif
+#if TINYSCT_CFG_HISTOGRAM
+    unsigned int    hist[MEASURE_BINS]; /* number of samples per bin */
+#endif
+}measure_t;
+
+/* Histogram bin of an absolute value, without a table in flash. */
+static inline unsigned char measureBin(unsigned int value)
+{
+unsigned char   bin = 1;
+
+    if(value < 4)
+        return 0;
+    if(value > 511)
+        return MEASURE_BINS - 1;
+    while(value >= 8){  /* at most 6 times */
+        value >>= 1;
+        bin += 2;
+    }
+    return bin + ((value >> 1) & 1);    /* 4..5 or 6..7 */
+}
+
+/* Absolute value of a bipolar ADC result, given as the raw ADCL and ADCH
+ * register values (10 bit two's complement). Returns 0..512.
+ */
+static inline unsigned int measureFold(unsigned char adcLo, unsigned char adcHi)
+{
+    if(adcHi > 1){
+        /* result is negative so clear sign in ADC9 and process two's complement value */
+        adcHi -= 2;
+        return 512 - (256 * adcHi + adcLo);
+    }
+    return 256 * adcHi + adcLo;
+}
+
+/* Signed value of a bipolar ADC result, -512..511. */
+static inline int measureSigned(unsigned char adcLo, unsigned char adcHi)
+{
+int     value = 256 * adcHi + adcLo;
+
+    if(value >= 512)
+        value -= 1024;
+    return value;
+}
+
+/* First order IIR high-pass filter with shifts and additions only: *state
+ * is the DC component times 2^shift, rounded it is subtracted from the
+ * sample. The result is in the range -1024..1023.
+ */
+static inline int measureHighPass(long *state, int value, unsigned char shift)
+{
+int     dc = (*state + (1L << (shift - 1))) >> shift;
+
+    value -= dc;
+    *state += value;
+    return value;
+}
+
+static inline void measureAdd(measure_t *m, unsigned int value)
+{
+    m->accu += value;
+    m->cnt++;
+#if TINYSCT_CFG_RMS
+    m->sqAccu += (unsigned long)value * value;
+#endif
+#if TINYSCT_CFG_PEAK
+    if(value > m->peak)
+        m->peak = value;
+#endif
+#if TINYSCT_CFG_HISTOGRAM
+    m->hist[measureBin(value)]++;
+#endif
+}
+
+static inline void measureClear(measure_t *m)
+{
+    m->accu = 0;
+    m->cnt = 0;
+#if TINYSCT_CFG_RMS
+    m->sqAccu = 0;
+#endif
+#if TINYSCT_CFG_PEAK
+    m->peak = 0;
+#endif
+#if TINYSCT_CFG_HISTOGRAM
+    {
+        unsigned char   i;
+        for(i = 0; i < MEASURE_BINS; i++)
+            m->hist[i] = 0;
+    }
+#endif
+}
+
+/* Average of the interval rounded to the nearest integer, 0 without samples.
+ * The average voltage is the peak voltage * 2/π for a sine.
+ */
+extern unsigned int measureAverage(const measure_t *m);
+
+#endif /* __measure_h_included__ */
@@ -0,0 +1,185 @@
+/* Name: tinysctconfig.h
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+#ifndef __tinysctconfig_h_included__
+#define __tinysctconfig_h_included__
+
+/*
+General Description:
+This file selects the features of the measurement firmware at compile time,
+in the same way usbconfig.h configures the USB driver. Features which are
+switched off are compiled out completely, including their code in the sample
+loop. Every value can be overridden on the compiler command line with
+-DNAME=value; the Makefile uses this to build the variants side by side.
+The vendor requests of a feature which is switched off return no data.
+*/
+
+/* ---------------------------- Interval ----------------------------------- */
+
+#ifndef TINYSCT_CFG_MAINS_HZ
+#define TINYSCT_CFG_MAINS_HZ        50
+#endif
+/* Mains frequency in Hz. Together with TINYSCT_CFG_CYCLES this determines
+ * the length of the interval.
+ */
+#ifndef TINYSCT_CFG_CYCLES
+#define TINYSCT_CFG_CYCLES          10
+#endif
+/* Number of mains cycles in an interval. The interval is counted by Timer1
+ * in ticks of 16384 CPU cycles and can be at most 255 ticks (253 ms) long,
+ * i.e. 12 cycles at 50 Hz or 15 cycles at 60 Hz.
+ */
+#ifndef TINYSCT_CFG_CONTINUOUS
+#define TINYSCT_CFG_CONTINUOUS      0
+#endif
+/* Window policy. Set to 0 to sample one interval per CLICMD_RUNADC, the
+ * results read as 0 while the interval is running. Set to 1 to start
+ * sampling at power-up and start the next interval as soon as one is
+ * complete; the results of the last completed interval can be read at any
+ * time. Use this with TINYSCT_CFG_ENERGY for continuous energy counting.
+ * This and the interval length are defaults only, the host can change them
+ * with CLICMD_SETCFG (see TINYSCT_CFG_EEPROM).
+ */
+
+/* ---------------------------- Estimators --------------------------------- */
+
+/* The mean of the absolute values (sum and count) is always computed. */
+
+#ifndef TINYSCT_CFG_RMS
+#define TINYSCT_CFG_RMS             0
+#endif
+/* Set to 1 to also sum the squares of the samples, for the true RMS value.
+ * Costs a 16x16 bit multiplication and a 32 bit addition per sample.
+ */
+#ifndef TINYSCT_CFG_PEAK
+#define TINYSCT_CFG_PEAK            0
+#endif
+/* Set to 1 to keep the largest absolute sample value of the interval. */
+#ifndef TINYSCT_CFG_ENERGY
+#define TINYSCT_CFG_ENERGY          1
+#endif
+/* Set to 1 to sum the averages of all intervals (CLICMD_GETNRG). */
+#ifndef TINYSCT_CFG_HPF_SHIFT
+#define TINYSCT_CFG_HPF_SHIFT       0
+#endif
+/* Set to a value from 1 to 14 to remove the DC component (ADC offset, CT
+ * remanence) from the samples with a first order high-pass filter before
+ * the absolute value is taken. The cutoff frequency is the sample rate
+ * (about 8 kHz) / (2π * 2^shift): 10 gives 1.2 Hz, which removes an offset
+ * within a few hundred ms of the first interval and changes the result of a
+ * 50 Hz signal by less than 0.1%. The filter state is kept across intervals.
+ * 0 compiles the filter out. Costs a 32 bit addition and shift per sample.
+ */
+
+/* ---------------------------- Buffers ------------------------------------ */
+
+#if defined(__AVR_ATtiny85__)
+#define TINYSCT_LARGE_RAM           1
+#else
+#define TINYSCT_LARGE_RAM           0
+#endif
+/* The attiny85 has twice the flash and SRAM of the attiny45. Buffer sizes
+ * default to larger values when building for it (make DEVICE=attiny85).
+ */
+#ifndef TINYSCT_CFG_CAPTURE_DEPTH
+#if TINYSCT_LARGE_RAM
+#define TINYSCT_CFG_CAPTURE_DEPTH   64
+#else
+#define TINYSCT_CFG_CAPTURE_DEPTH   0
+#endif
+#endif
+/* Number of raw samples kept from the start of each interval for
+ * CLICMD_GETCAP, 2 bytes of SRAM each. 0 compiles the capture out. The
+ * capture is not available in continuous mode, CLICMD_GETCAP returns no data.
+ * The attiny85 default leaves room for the stack next to the histogram, the
+ * per-cycle results and the USB buffers; checksize only counts .data and
+ * .bss, so check larger values with the fuzzer of the simulation, which
+ * reports the lowest stack pointer.
+ */
+#ifndef TINYSCT_CFG_HISTOGRAM
+#define TINYSCT_CFG_HISTOGRAM       TINYSCT_LARGE_RAM
+#endif
+/* Set to 1 to count the absolute sample values of each interval in 16
+ * logarithmically spaced bins (CLICMD_GETHIST). The counters are part of
+ * the interval state, which costs 64 bytes of SRAM: 32 for the interval in
+ * progress and 32 for the last result.
+ */
+
+#ifndef TINYSCT_CFG_CYCLE_DEPTH
+#if TINYSCT_LARGE_RAM
+#define TINYSCT_CFG_CYCLE_DEPTH     8
+#else
+#define TINYSCT_CFG_CYCLE_DEPTH     4
+#endif
+#endif
+/* Number of mains cycles whose results are kept for CLICMD_GETCYCLE, 4 bytes
+ * of SRAM each, a power of 2. A cycle ends at the zero crossing of the
+ * signal, so the host sees a load change after 20 ms instead of at the end
+ * of the interval. 0 compiles the cycle results out.
+ */
+#ifndef TINYSCT_CFG_LOG_DEPTH
+#if TINYSCT_LARGE_RAM
+#define TINYSCT_CFG_LOG_DEPTH       160
+#else
+#define TINYSCT_CFG_LOG_DEPTH       0
+#endif
+#endif
+/* Number of entries in the EEPROM log of coarse averages (CLICMD_GETLOG),
+ * 3 bytes of EEPROM each, at most 255. 0 compiles the log out. Entries are
+ * only logged in continuous mode (CLICMD_SETCFG). The attiny45 has 256 bytes
+ * of EEPROM, room for 80 entries, but little flash left for the code.
+ */
+#ifndef TINYSCT_CFG_LOG_INTERVALS
+#define TINYSCT_CFG_LOG_INTERVALS   1500
+#endif
+/* Number of intervals averaged into a log entry: 1500 intervals of 200 ms
+ * are 5 minutes, so 160 entries cover more than 13 hours.
+ */
+
+/* ---------------------------- Device ------------------------------------- */
+
+#ifndef TINYSCT_CFG_WARM_RESTART
+#define TINYSCT_CFG_WARM_RESTART    1
+#endif
+/* Set to 1 to keep the results and energy counters across watchdog and
+ * brown-out resets and to skip the long USB disconnect after such a reset.
+ */
+#ifndef TINYSCT_CFG_EEPROM
+#define TINYSCT_CFG_EEPROM          1
+#endif
+/* Set to 1 to store the configuration written with CLICMD_SETCFG (interval
+ * length, window policy, input gain) in EEPROM and to apply it at boot. With
+ * 0 the configuration is lost on every reset.
+ */
+#ifndef TINYSCT_CFG_SERIAL
+#define TINYSCT_CFG_SERIAL          TINYSCT_CFG_EEPROM
+#endif
+/* Set to 1 to give the device a serial number string descriptor, so several
+ * meters can be told apart on one host. The number is kept in EEPROM; see
+ * CLICMD_SETSERIAL.
+ */
+#ifndef TINYSCT_CFG_MEASURE
+#define TINYSCT_CFG_MEASURE         1
+#endif
+/* Set to 1 to implement CLICMD_MEASURE, which returns the result of an
+ * interval in a single control transfer. The firmware samples inside
+ * usbFunctionSetup() until the interval is complete, the delay plus the
+ * interval (up to about 455 ms). usbPoll() does not run during that time, so
+ * a bus reset or a new address from the host is only handled afterwards;
+ * the host must not send other requests meanwhile. The EEPROM writes go on.
+ * The stall is left out of the CLICMD_GETPERF figures.
+ */
+#ifndef TINYSCT_CFG_PERF
+#define TINYSCT_CFG_PERF            1
+#endif
+/* Set to 1 to record main loop and USB handler timing (CLICMD_GETPERF).
+ * This uses Timer0 and adds a few instructions to every loop iteration.
+ */
+
+#endif /* __tinysctconfig_h_included__ */
@@ -0,0 +1,238 @@
+/* Name: benchmeasure.c
+ * Project: tinysct
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+/*
+General Description:
+Host build of the firmware's measurement core (firmware/measure.c). It first
+compares measureFold() for every ADC code from -512 to 511, measureBin() for
+every absolute value, measureAverage() for a range of sums and
+measureSigned() with measureHighPass() sample by sample against a plain
+reference, then processes a few million synthetic samples and prints the time
+per sample, without and with the high-pass filter. Finally it shows the error
+of the mean absolute value of a sine with a DC offset, without and with the
+filter, for short and long intervals, with the filter settled and from a cold
+start.
+Use it to check that a faster implementation gives identical results.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "measure.h"
+
+#define BENCH_SAMPLES   (1L << 24)
+#define BENCH_WINDOW    1600        /* samples per 200 ms interval */
+#define BENCH_HPF_SHIFT 10          /* see TINYSCT_CFG_HPF_SHIFT */
+#define SAMPLE_RATE     8000.0      /* samples per second */
+#define HPF_SAMPLES     100000      /* samples per signal in the filter check */
+
+static double   nowNs(void)
+{
+struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* raw ADCL/ADCH of the bipolar ADC for a signed code */
+static void rawCode(int code, unsigned char *lo, unsigned char *hi)
+{
+unsigned int    raw = code & 0x3ff;
+
+    *lo = raw & 0xff;
+    *hi = raw >> 8;
+}
+
+/* ADC code of a 50 Hz sine with the given amplitude and offset at sample t */
+static int  sineCode(double amplitude, double offset, long t)
+{
+int     code = (int)floor(amplitude * sin(2 * M_PI * 50 * t / SAMPLE_RATE) + offset + 0.5);
+
+    if(code > 511)
+        code = 511;
+    if(code < -512)
+        code = -512;
+    return code;
+}
+
+/* Run measureSigned() and measureHighPass() over a signal and compare each
+ * sample with a filter in double precision. The firmware rounds the DC
+ * estimate to whole counts, so the results may differ by one count.
+ */
+static int  verifyHighPass(const char *name, int signal)
+{
+unsigned char   lo, hi;
+long            state = 0, t;
+double          dc = 0, ref;
+int             code, value, errors = 0;
+
+    for(t = 0; t < HPF_SAMPLES; t++){
+        switch(signal){
+        case 0:     /* sine with an offset, settling from a cold start */
+            code = sineCode(300, 50, t);
+            break;
+        case 1:     /* full scale noise */
+            code = rand() % 1024 - 512;
+            break;
+        default:    /* steps between the rails */
+            code = t / 4000 % 2 ? 511 : -512;
+            break;
+        }
+        rawCode(code, &lo, &hi);
+        if(measureSigned(lo, hi) != code){
+            fprintf(stderr, "measureSigned(%d) = %d\n", code, measureSigned(lo, hi));
+            errors++;
+        }
+        value = measureHighPass(&state, measureSigned(lo, hi), BENCH_HPF_SHIFT);
+        ref = code - dc;
+        dc += ref / (1 << BENCH_HPF_SHIFT);
+        if(fabs(value - ref) > 1){
+            if(errors++ < 10)
+                fprintf(stderr, "measureHighPass(%s) sample %ld: %d, expected %.2f\n", name, t, value, ref);
+        }
+    }
+    return errors;
+}
+
+static int  verify(void)
+{
+static const unsigned int   edges[MEASURE_BINS - 1] = {4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+unsigned char   lo, hi;
+unsigned long   accu;
+unsigned int    cnt, expect;
+measure_t       m;
+int             code, i, errors = 0;
+
+    for(code = -512; code <= 511; code++){
+        rawCode(code, &lo, &hi);
+        if(measureFold(lo, hi) != (unsigned int)abs(code)){
+            fprintf(stderr, "measureFold(%d) = %u\n", code, measureFold(lo, hi));
+            errors++;
+        }
+    }
+    for(code = 0; code <= 512; code++){
+        for(i = 0; i < MEASURE_BINS - 1 && (unsigned int)code >= edges[i]; i++)
+            ;
+        if(measureBin(code) != i){
+            fprintf(stderr, "measureBin(%d) = %u, expected %d\n", code, measureBin(code), i);
+            errors++;
+        }
+    }
+    for(cnt = 0; cnt < 2000; cnt += 7){
+        for(accu = 0; accu <= 512UL * cnt; accu += 97){
+            m.accu = accu;
+            m.cnt = cnt;
+            expect = cnt ? (unsigned int)((double)accu / cnt + 0.5) : 0; /* what the firmware used to do */
+            if(measureAverage(&m) != expect){
+                fprintf(stderr, "measureAverage(%lu, %u) = %u, expected %u\n", accu, cnt, measureAverage(&m), expect);
+                errors++;
+            }
+        }
+    }
+    errors += verifyHighPass("sine", 0);
+    errors += verifyHighPass("noise", 1);
+    errors += verifyHighPass("steps", 2);
+    return errors;
+}
+
+/* Mean absolute value of n samples of a 50 Hz sine with the given amplitude
+ * and offset in ADC counts, starting at sample t0. With state != NULL the
+ * samples are filtered first.
+ */
+static double   sineMean(double amplitude, double offset, long t0, int n, long *state)
+{
+unsigned long   accu = 0;
+int             i, code;
+
+    for(i = 0; i < n; i++){
+        code = sineCode(amplitude, offset, t0 + i);
+        if(state != NULL)
+            code = measureHighPass(state, code, BENCH_HPF_SHIFT);
+        accu += abs(code);
+    }
+    return (double)accu / n;
+}
+
+/* Small signals suffer most: once the offset exceeds the amplitude the mean
+ * of the absolute values is the offset. The filter needs about 2^shift
+ * samples to settle, so from a cold start (state 0, as after power-up) it
+ * removes little of the offset within a short interval.
+ */
+static void offsetError(void)
+{
+static const double amplitudes[] = {300, 20};
+static const double offsets[] = {0, 5, 20, 50};
+static const int    cycles[] = {1, 10};
+double  raw, hpf, cold, exact;
+long    state, coldState;
+int     a, i, j, n;
+
+    for(a = 0; a < 2 * 4 * 2; a++){
+        i = a / 2 % 4;  /* offset */
+        j = a % 2;      /* cycles */
+        if(a % 8 == 0)
+            printf("error of the mean with DC offset, %.0f counts 50 Hz sine, shift %d:\n", amplitudes[a / 8], BENCH_HPF_SHIFT);
+        n = (int)(cycles[j] * SAMPLE_RATE / 50);
+        state = 0;
+        sineMean(amplitudes[a / 8], offsets[i], 0, (int)SAMPLE_RATE, &state);  /* 1 s to settle */
+        exact = sineMean(amplitudes[a / 8], 0, (long)SAMPLE_RATE, n, NULL);
+        raw = sineMean(amplitudes[a / 8], offsets[i], (long)SAMPLE_RATE, n, NULL);
+        hpf = sineMean(amplitudes[a / 8], offsets[i], (long)SAMPLE_RATE, n, &state);
+        coldState = 0;
+        cold = sineMean(amplitudes[a / 8], offsets[i], (long)SAMPLE_RATE, n, &coldState);
+        printf("  offset %2.0f, %2d cycles: without filter %+7.2f%%, with filter %+6.2f%%, cold start %+7.2f%%\n",
+            offsets[i], cycles[j], 100 * (raw - exact) / exact, 100 * (hpf - exact) / exact, 100 * (cold - exact) / exact);
+    }
+}
+
+int main(int argc, char **argv)
+{
+static unsigned char    lo[BENCH_WINDOW], hi[BENCH_WINDOW];
+measure_t       m;
+unsigned long   check = 0;
+long            n;
+double          start, ns;
+int             i;
+
+    if(verify() != 0){
+        printf("FAIL\n");
+        return 1;
+    }
+    srand(1);
+    for(i = 0; i < BENCH_WINDOW; i++)
+        rawCode(rand() % 1024 - 512, &lo[i], &hi[i]);
+    start = nowNs();
+    for(n = 0; n < BENCH_SAMPLES; n += BENCH_WINDOW){
+        measureClear(&m);
+        for(i = 0; i < BENCH_WINDOW; i++)
+            measureAdd(&m, measureFold(lo[i], hi[i]));
+        check += measureAverage(&m);
+    }
+    ns = nowNs() - start;
+    printf("%ld samples in %.1f ms, %.2f ns/sample (check %lu)\n", n, ns / 1e6, ns / n, check);
+    {
+        long    state = 0;
+        int     value;
+
+        check = 0;
+        start = nowNs();
+        for(n = 0; n < BENCH_SAMPLES; n += BENCH_WINDOW){
+            measureClear(&m);
+            for(i = 0; i < BENCH_WINDOW; i++){
+                value = measureHighPass(&state, measureSigned(lo[i], hi[i]), BENCH_HPF_SHIFT);
+                measureAdd(&m, value < 0 ? -value : value);
+            }
+            check += measureAverage(&m);
+        }
+        ns = nowNs() - start;
+        printf("with high-pass filter: %.2f ns/sample (check %lu)\n", ns / n, check);
+    }
+    offsetError();
+    return 0;
+}
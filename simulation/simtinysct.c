@@ -0,0 +1,692 @@
+/* Name: simtinysct.c
+ * Project: tinysct based on AVR USB driver
+ * Author: Silvester Vossen
+ * Creation Date: 2026-10-19
+ * License: GNU GPL v2 (see License.txt) or proprietary (CommercialLicense.txt)
+ * This Revision: $Id$
+ */
+
+/*
+General Description:
+This program runs the real firmware (firmware/main.bin) cycle accurately in
+simavr, feeds the ADC2-ADC3 differential input from a synthetic current
+waveform and sends vendor requests to the firmware. It reports the results of
+the firmware next to the results expected from the samples it fed, and the
+number of CPU cycles per sample.
+
+USB is not simulated on the wire. Requests are injected the way the V-USB
+interrupt routine would leave them: the SETUP packet is written into
+usbRxBuf and usbRxLen is set, usbPoll() in the firmware processes it, and the
+reply is taken from usbTxBuf. The symbol addresses are read with avr-nm.
+D- is held high (idle state) so the firmware never sees a USB reset and does
+not try to calibrate its oscillator.
+
+With -z the program fuzzes the request handler instead: it sends random and
+adversarial SETUP packets while a measurement runs, checks invariants after
+each one and records the worst case number of cycles spent in
+usbFunctionSetup(). See fuzz() for the invariants.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_adc.h>
+#include <simavr/avr_ioport.h>
+
+/* I/O register addresses of the attiny45 (the same on the attiny85) from
+ * avr-libc, as data space addresses, the way simavr's cores include them.
+ */
+#define _AVR_IO_H_
+#define _SFR_IO8(io)    ((io) + 0x20)
+#include <avr/iotn45.h>
+
+#define F_CPU           16500000
+#define VREF_MV         1100    /* internal reference, bipolar range is +/- VREF */
+#define BIAS_MV         1000    /* common mode voltage of ADC2 and ADC3 */
+
+#define CLICMD_ECHO   0
+#define CLICMD_GETOSC 1
+#define CLICMD_RUNADC 6
+#define CLICMD_GETADC 7
+#define CLICMD_GETACC 8
+#define CLICMD_GETCNT 9
+#define CLICMD_GETRST 10
+#define CLICMD_GETNRG 11
+#define CLICMD_GETPERF 12
+#define CLICMD_MEASURE 13
+#define CLICMD_GETCAP 15
+#define CLICMD_GETHIST 16
+#define CLICMD_SETCFG 18
+#define CLICMD_LAST   22
+
+#define USBRQ_TYPE_CLASS    (1 << 5)
+#define USBRQ_HID_SET_REPORT 9
+
+#define USBRQ_TYPE_VENDOR   (2 << 5)
+#define USBRQ_DIR_IN        0x80
+#define USB_BUFSIZE         11
+#define USBPID_SETUP        0x2d
+#define USBPID_OUT          0xe1
+#define USBPID_DATA0        0xc3
+#define USBPID_DATA1        0x4b
+#define USBPID_NAK          0x5a
+#define USBPID_STALL        0x1e
+
+typedef unsigned char   uchar;
+
+#define US_TO_CYCLES(us)    ((avr_cycle_count_t)(us) * (F_CPU / 1000000.0))
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct symbols{
+    unsigned    usbRxBuf;
+    unsigned    usbRxLen;
+    unsigned    usbRxToken;
+    unsigned    usbInputBufOffset;
+    unsigned    usbTxBuf;
+    unsigned    usbTxLen;
+    unsigned    intervalRunning;
+    /* optional, used by the fuzzer */
+    unsigned    usbFunctionSetup;
+    unsigned    resetCause;
+    unsigned    __heap_start;
+}symbols_t;
+
+#define SYMBOLS_REQUIRED    7
+
+static symbols_t    sym;
+static avr_t        *avr;
+
+static char         *waveform = "sine";
+static double       amplitude = 500;    /* peak in mV */
+static double       offset;             /* DC offset in mV */
+static double       frequency = 50;
+static double       clipLevel = 0.5;    /* fraction of amplitude for "clipped" */
+static double       stepMs = 100;       /* period of the amplitude steps for "step" */
+static int          verbose;
+static int          quiet;              /* timeouts are expected while fuzzing */
+static int          hpfShift;           /* TINYSCT_CFG_HPF_SHIFT of the firmware */
+
+/* what the firmware should have seen */
+#define MODEL_CAPTURE   256
+static unsigned long        modelAccu, modelCnt;
+static int                  modelCapture[MODEL_CAPTURE];
+#define MODEL_BINS      16
+static unsigned long        modelHist[MODEL_BINS];
+static avr_cycle_count_t    firstSampleCycle, lastSampleCycle;
+
+/* ------------------------------------------------------------------------- */
+
+static int  lookupSymbols(char *elf)
+{
+char    cmd[1024], line[256], name[128], type;
+unsigned    addr;
+FILE    *fp;
+int     n = 0;
+
+    snprintf(cmd, sizeof(cmd), "avr-nm %s", elf);
+    if((fp = popen(cmd, "r")) == NULL){
+        perror("avr-nm");
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL){
+        if(sscanf(line, "%x %c %127s", &addr, &type, name) != 3)
+            continue;
+        addr &= 0xffff; /* data addresses are offset by 0x800000 */
+#define SYM(s)  if(strcmp(name, #s) == 0){ sym.s = addr; n++; }
+        SYM(usbRxBuf) SYM(usbRxLen) SYM(usbRxToken) SYM(usbInputBufOffset)
+        SYM(usbTxBuf) SYM(usbTxLen) SYM(intervalRunning)
+#undef SYM
+#define SYM(s)  if(strcmp(name, #s) == 0){ sym.s = addr; }
+        SYM(usbFunctionSetup) SYM(resetCause) SYM(__heap_start)
+#undef SYM
+    }
+    pclose(fp);
+    if(n != SYMBOLS_REQUIRED){
+        fprintf(stderr, "%s: not all symbols found (%d)\n", elf, n);
+        return -1;
+    }
+    return 0;
+}
+
+/* Current waveform in mV at time t (seconds). */
+static double   waveValue(double t)
+{
+double  s = sin(2 * M_PI * frequency * t), v;
+
+    if(strcmp(waveform, "clipped") == 0){
+        v = amplitude * s;
+        if(v > clipLevel * amplitude)
+            v = clipLevel * amplitude;
+        else if(v < -clipLevel * amplitude)
+            v = -clipLevel * amplitude;
+    }else if(strcmp(waveform, "smps") == 0){
+        /* rectifier with capacitor: current only flows near the voltage peaks */
+        v = fabs(s) > 0.9 ? amplitude * (fabs(s) - 0.9) / 0.1 : 0;
+        if(s < 0)
+            v = -v;
+    }else if(strcmp(waveform, "step") == 0){
+        v = amplitude * s;
+        if((long)(t * 1000 / stepMs) & 1)
+            v /= 4;
+    }else{
+        v = amplitude * s;
+    }
+    return v + offset;
+}
+
+static int  adcCode(double mV)
+{
+int     code = (int)floor(mV * 512 / VREF_MV);
+
+    if(code > 511)
+        code = 511;
+    if(code < -512)
+        code = -512;
+    return code;
+}
+
+/* Histogram bin of an absolute ADC value, as documented in measure.h */
+static int  histBin(int value)
+{
+static const int    edges[MODEL_BINS - 1] = {4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+int     bin = 0;
+
+    while(bin < MODEL_BINS - 1 && value >= edges[bin])
+        bin++;
+    return bin;
+}
+
+/* Called by simavr when the firmware reads ADCL, which is when simavr
+ * computes the result of a conversion: present the input for it. Every
+ * sample the firmware reads is counted exactly once here, which the
+ * comparison of the sample count relies on; a conversion that is started
+ * but never read is not counted.
+ */
+static void adcTrigger(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+static long hpfState;
+double  mV = waveValue(avr->cycle / (double)F_CPU);
+int     code = adcCode(mV), folded = code, dc;
+
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC2), (uint32_t)(BIAS_MV + mV));
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC3), BIAS_MV);
+    if(modelCnt == 0)
+        firstSampleCycle = avr->cycle;
+    lastSampleCycle = avr->cycle;
+    if(hpfShift){   /* same integer arithmetic as measureHighPass() */
+        dc = (hpfState + (1L << (hpfShift - 1))) >> hpfShift;
+        folded -= dc;
+        hpfState += folded;
+    }
+    if(folded < 0)
+        folded = -folded;
+    modelAccu += folded;
+    modelHist[histBin(folded)]++;
+    if(modelCnt < MODEL_CAPTURE)
+        modelCapture[modelCnt] = code;
+    modelCnt++;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Handler timing and stack use, measured per instruction while tracing. */
+#define R_SPL   0x5d
+#define R_SPH   0x5e
+
+static int                  traceSetup;
+static unsigned             setupSp, minSp = 0xffff;
+static avr_cycle_count_t    setupStart, setupCycles, setupMaxCycles;
+
+static void traceInstruction(void)
+{
+unsigned    sp = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+
+    if(sp < minSp)
+        minSp = sp;
+    if(avr->pc == sym.usbFunctionSetup && setupSp == 0){
+        setupSp = sp;       /* return address is on the stack */
+        setupStart = avr->cycle;
+    }else if(setupSp != 0 && sp > setupSp){   /* returned */
+        setupCycles = avr->cycle - setupStart;
+        if(setupCycles > setupMaxCycles)
+            setupMaxCycles = setupCycles;
+        setupSp = 0;
+    }
+}
+
+static int  runUntil(avr_cycle_count_t cycle)
+{
+int     state;
+
+    while(avr->cycle < cycle){
+        state = avr_run(avr);   /* one instruction */
+        if(state == cpu_Done || state == cpu_Crashed){
+            fprintf(stderr, "simulation stopped at cycle %llu (state %d)\n", (unsigned long long)avr->cycle, state);
+            return -1;
+        }
+        if(traceSetup)
+            traceInstruction();
+    }
+    return 0;
+}
+
+static void runMs(double ms)
+{
+    if(runUntil(avr->cycle + US_TO_CYCLES(ms * 1000)) < 0)
+        exit(1);
+}
+
+/* Hand a packet to the firmware as if the interrupt routine had received it
+ * and wait until usbPoll() has processed it. usbPoll() passes the data after
+ * the PID to usbProcessRx(), the PID itself is in the byte before.
+ */
+static int  injectPacket(uchar token, uchar pid, uchar *data, int len)
+{
+unsigned    buf = sym.usbRxBuf + USB_BUFSIZE + 1 - avr->data[sym.usbInputBufOffset];
+avr_cycle_count_t   timeout = avr->cycle + US_TO_CYCLES(100000);
+
+    while(avr->data[sym.usbRxLen] != 0){    /* wait for the buffer to be free */
+        if(avr->cycle > timeout || runUntil(avr->cycle + 100) < 0)
+            return -1;
+    }
+    avr->data[buf - 1] = pid;
+    memcpy(&avr->data[buf], data, len);
+    avr->data[buf + len] = avr->data[buf + len + 1] = 0;    /* CRC is not checked */
+    avr->data[sym.usbRxToken] = token;
+    avr->data[sym.usbRxLen] = len + 3;
+    while(avr->data[sym.usbRxLen] != 0){
+        if(avr->cycle > timeout || runUntil(avr->cycle + 100) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Collect the reply of a control-in transfer, packet by packet, like the
+ * host's IN tokens would.
+ */
+static int  collectReply(uchar *reply, int maxLen, avr_cycle_count_t timeout)
+{
+int     n = 0, len;
+uchar   txLen;
+
+    for(;;){
+        while((txLen = avr->data[sym.usbTxLen]) & 0x10){    /* NAK: nothing built yet */
+            if(avr->cycle > timeout){
+                if(!quiet)
+                    fprintf(stderr, "timeout waiting for reply\n");
+                return -1;
+            }
+            if(runUntil(avr->cycle + 100) < 0)
+                return -1;
+        }
+        if(txLen == USBPID_STALL){
+            avr->data[sym.usbTxLen] = USBPID_NAK;
+            return -1;
+        }
+        len = txLen - 4;
+        if(n + len > maxLen)
+            len = maxLen - n;
+        memcpy(reply + n, &avr->data[sym.usbTxBuf + 1], len);
+        n += len;
+        avr->data[sym.usbTxLen] = USBPID_NAK;   /* packet sent */
+        if(txLen - 4 < 8)
+            return n;
+    }
+}
+
+static int  vendorRequestIndex(uchar request, unsigned value, unsigned index, uchar *reply, int maxLen)
+{
+uchar   setup[8] = {USBRQ_TYPE_VENDOR | USBRQ_DIR_IN, request, value & 0xff, value >> 8, index & 0xff, index >> 8, maxLen & 0xff, maxLen >> 8};
+avr_cycle_count_t   start = avr->cycle;
+
+    if(injectPacket(USBPID_SETUP, USBPID_DATA0, setup, sizeof(setup)) < 0)
+        return -1;
+    return collectReply(reply, maxLen, start + US_TO_CYCLES(5000000));  /* like tinysct */
+}
+
+/* Control-out transfer: SETUP and the data packets. Returns 0 if the device
+ * acknowledged with a zero length status packet, -1 otherwise.
+ */
+static int  controlOut(uchar *setup, uchar *data, int len)
+{
+uchar   status[8];
+int     n;
+
+    if(injectPacket(USBPID_SETUP, USBPID_DATA0, setup, 8) < 0)
+        return -1;
+    for(n = 0; n < len; n += 8){
+        if(injectPacket(USBPID_OUT, (n / 8) & 1 ? USBPID_DATA0 : USBPID_DATA1, data + n, len - n > 8 ? 8 : len - n) < 0)
+            return -1;
+    }
+    return collectReply(status, sizeof(status), avr->cycle + US_TO_CYCLES(100000)) == 0 ? 0 : -1;
+}
+
+static int  vendorRequest(uchar request, unsigned value, uchar *reply, int maxLen)
+{
+    return vendorRequestIndex(request, value, 0, reply, maxLen);
+}
+
+/* Compare the raw capture of the firmware, if it has one, with the codes
+ * fed. Returns the number of mismatches.
+ */
+static int  checkCapture(void)
+{
+uchar   samples[128];
+int     n = 0, i, len, code, errors = 0;
+
+    do{
+        len = vendorRequestIndex(CLICMD_GETCAP, 0, n, samples, sizeof(samples));
+        for(i = 0; i + 1 < len && n < MODEL_CAPTURE; i += 2, n++){
+            code = (samples[i] | samples[i + 1] << 8) & 0x3ff;
+            if(code >= 512)
+                code -= 1024;
+            if(code != modelCapture[n])
+                errors++;
+        }
+    }while(len == sizeof(samples));
+    if(n > 0)
+        printf("  capture: %d samples, %d mismatches\n", n, errors);
+    return errors;
+}
+
+/* Compare the histogram of the firmware, if it has one, with the samples
+ * fed. Returns the number of bins which differ.
+ */
+static int  checkHistogram(void)
+{
+uchar   hist[2 * MODEL_BINS];
+int     i, errors = 0;
+
+    if(vendorRequest(CLICMD_GETHIST, 0, hist, sizeof(hist)) != sizeof(hist))
+        return 0;
+    for(i = 0; i < MODEL_BINS; i++){
+        if((unsigned)(hist[2 * i] | hist[2 * i + 1] << 8) != modelHist[i])
+            errors++;
+    }
+    printf("  histogram: %d bins differ\n", errors);
+    if(verbose){
+        for(i = 0; i < MODEL_BINS; i++)
+            printf("  %2d: %5u (fed %lu)\n", i, hist[2 * i] | hist[2 * i + 1] << 8, modelHist[i]);
+    }
+    return errors;
+}
+
+static unsigned long    le(uchar *p, int len)
+{
+unsigned long   v = 0;
+
+    while(len-- > 0)
+        v = (v << 8) | p[len];
+    return v;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- fuzzer -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Requests that start or end an interval are sent only at controlled times,
+ * otherwise the model of the running measurement would not be valid. A new
+ * configuration (interval length, gain) is never sent.
+ */
+static int  startsInterval(uchar *setup)
+{
+    if((setup[0] & 0x60) == USBRQ_TYPE_VENDOR)
+        return setup[1] == CLICMD_RUNADC || setup[1] == CLICMD_MEASURE;
+    if((setup[0] & 0x60) == USBRQ_TYPE_CLASS)
+        return setup[1] == USBRQ_HID_SET_REPORT;
+    return 0;
+}
+
+static unsigned fuzzWord(void)
+{
+static const unsigned   edges[] = {0, 1, 2, 7, 8, 9, 127, 128, 254, 255, 256, 0x7fff, 0x8000, 0xfffe, 0xffff};
+
+    if(rand() & 1)
+        return edges[rand() % (sizeof(edges) / sizeof(edges[0]))];
+    return rand() & 0xffff;
+}
+
+static void fuzzSetup(uchar *setup)
+{
+static const uchar  types[] = {0x00, 0x80, 0x01, 0x81, 0x02, 0x82, USBRQ_TYPE_CLASS | 0x01, USBRQ_TYPE_CLASS | 0x81, USBRQ_TYPE_VENDOR, USBRQ_TYPE_VENDOR | 0x80};
+unsigned    w;
+int         i;
+
+    setup[0] = rand() % 4 ? types[rand() % sizeof(types)] : rand();
+    setup[1] = rand() % 4 ? rand() % (CLICMD_LAST + 2) : rand();
+    for(i = 2; i < 8; i += 2){
+        w = fuzzWord();
+        setup[i] = w & 0xff;
+        setup[i + 1] = w >> 8;
+    }
+}
+
+/* Invariants checked after every request:
+ *  - the reply of a control-in request is not longer than wLength
+ *  - the firmware did not reset (resetCause unchanged) or crash
+ *  - the stack never grew into the variables (SP above __heap_start)
+ *  - the device answers an echo request correctly
+ * and after every round the result of the measurement which ran during the
+ * requests matches the samples fed.
+ */
+static int  fuzz(int rounds)
+{
+uchar       setup[8], reply[300], data[32], cause = avr->data[sym.resetCause];
+unsigned    wLength;
+long        requests = 0, stalls = 0;
+int         round, i, len, errors = 0;
+unsigned long       accu, cnt;
+avr_cycle_count_t   worstMeasure = 0, prevMax;
+
+    if(sym.usbFunctionSetup == 0 || sym.resetCause == 0 || sym.__heap_start == 0){
+        fprintf(stderr, "firmware lacks symbols needed for fuzzing\n");
+        return 1;
+    }
+    traceSetup = quiet = 1;
+    for(round = 0; round < rounds && errors == 0; round++){
+        modelAccu = modelCnt = 0;
+        memset(modelHist, 0, sizeof(modelHist));
+        vendorRequest(CLICMD_RUNADC, 0, reply, 0);
+        while(avr->data[sym.intervalRunning] && errors == 0){
+            fuzzSetup(setup);
+            if((setup[0] & 0x60) == USBRQ_TYPE_VENDOR && setup[1] == CLICMD_SETCFG)
+                continue;
+            if(startsInterval(setup)){
+                /* a start while running must be ignored; but not too close
+                 * to the end, a new interval would spoil the comparison */
+                if(avr->data[TCNT1] > 240)  /* the interval ends at 255 */
+                    continue;
+            }
+            wLength = setup[6] | setup[7] << 8;
+            prevMax = setupMaxCycles;
+            if(setup[0] & USBRQ_DIR_IN){
+                if(injectPacket(USBPID_SETUP, USBPID_DATA0, setup, 8) < 0){
+                    fprintf(stderr, "round %d: device does not accept SETUP\n", round);
+                    errors++;
+                    break;
+                }
+                len = collectReply(reply, sizeof(reply), avr->cycle + US_TO_CYCLES(1000000));
+                if(len < 0){
+                    stalls++;
+                }else if((unsigned)len > wLength){
+                    fprintf(stderr, "round %d: %d bytes reply for wLength %u (request %02x %02x)\n", round, len, wLength, setup[0], setup[1]);
+                    errors++;
+                }
+            }else{
+                for(i = 0; i < (int)sizeof(data); i++)
+                    data[i] = rand();
+                if(controlOut(setup, data, wLength > sizeof(data) ? sizeof(data) : wLength) < 0)
+                    stalls++;
+            }
+            requests++;
+            if(setup[1] == CLICMD_MEASURE && (setup[0] & 0x60) == USBRQ_TYPE_VENDOR){
+                if(setupCycles > worstMeasure)
+                    worstMeasure = setupCycles;
+                setupMaxCycles = prevMax;   /* waiting for the interval is not handler latency */
+            }
+            if(avr->data[sym.resetCause] != cause){
+                fprintf(stderr, "round %d: firmware was reset (request %02x %02x)\n", round, setup[0], setup[1]);
+                errors++;
+            }
+            if(minSp <= sym.__heap_start){
+                fprintf(stderr, "round %d: stack overflow, SP = 0x%x\n", round, minSp);
+                errors++;
+            }
+            if(vendorRequest(CLICMD_ECHO, requests & 0xffff, reply, 2) != 2 || le(reply, 2) != (requests & 0xffff)){
+                fprintf(stderr, "round %d: echo failed after request %02x %02x\n", round, setup[0], setup[1]);
+                errors++;
+            }
+        }
+        while(avr->data[sym.intervalRunning])   /* a MEASURE may have left it running */
+            runMs(1);
+        if(vendorRequest(CLICMD_GETACC, 0, reply, 3) != 3 || vendorRequest(CLICMD_GETCNT, 0, reply + 4, 2) != 2){
+            fprintf(stderr, "round %d: cannot read result\n", round);
+            errors++;
+            break;
+        }
+        accu = le(reply, 3);
+        cnt = le(reply + 4, 2);
+        if(cnt != modelCnt || accu != (modelAccu & 0xffffff)){
+            fprintf(stderr, "round %d: result %lu/%lu, fed %lu/%lu\n", round, accu, cnt, modelAccu, modelCnt);
+            errors++;
+        }
+        if(verbose)
+            printf("round %d: %ld requests so far, worst case %llu cycles\n", round, requests, (unsigned long long)setupMaxCycles);
+    }
+    traceSetup = quiet = 0;
+    printf("%d rounds, %ld requests, %ld stalled\n", round, requests, stalls);
+    printf("usbFunctionSetup worst case: %llu cycles (%.1f us)\n", (unsigned long long)setupMaxCycles, setupMaxCycles * 1e6 / F_CPU);
+    if(worstMeasure)
+        printf("CLICMD_MEASURE worst case: %llu cycles (%.1f ms)\n", (unsigned long long)worstMeasure, worstMeasure * 1e3 / F_CPU);
+    printf("stack headroom: %d bytes\n", (int)minSp - (int)sym.__heap_start);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [options] main.bin\n", name);
+    fprintf(stderr, "  -w sine|clipped|smps|step   waveform (default sine)\n");
+    fprintf(stderr, "  -a mV       peak amplitude (default 500)\n");
+    fprintf(stderr, "  -o mV       DC offset (default 0)\n");
+    fprintf(stderr, "  -f Hz       mains frequency (default 50)\n");
+    fprintf(stderr, "  -c frac     clip level for clipped (default 0.5)\n");
+    fprintf(stderr, "  -s ms       step period for step (default 100)\n");
+    fprintf(stderr, "  -n count    number of measurements (default 3)\n");
+    fprintf(stderr, "  -m          use CLICMD_MEASURE instead of runadc/getacc/getcnt\n");
+    fprintf(stderr, "  -M mcu      device if not recorded in the firmware (default attiny45)\n");
+    fprintf(stderr, "  -H shift    firmware built with TINYSCT_CFG_HPF_SHIFT=shift\n");
+    fprintf(stderr, "  -z rounds   fuzz the request handler for the given number of measurements\n");
+    fprintf(stderr, "  -S seed     random seed for -z (default 1)\n");
+    fprintf(stderr, "  -v          verbose\n");
+}
+
+int main(int argc, char **argv)
+{
+elf_firmware_t  firmware;
+uchar           reply[16];
+int             opt, i, count = 3, useMeasure = 0, errors = 0, fuzzRounds = 0;
+unsigned        seed = 1;
+char            *mcu = "attiny45";
+unsigned long   accu, cnt;
+
+    while((opt = getopt(argc, argv, "w:a:o:f:c:s:n:mM:H:z:S:v")) != -1){
+        switch(opt){
+        case 'w': waveform = optarg; break;
+        case 'a': amplitude = atof(optarg); break;
+        case 'o': offset = atof(optarg); break;
+        case 'f': frequency = atof(optarg); break;
+        case 'c': clipLevel = atof(optarg); break;
+        case 's': stepMs = atof(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'm': useMeasure = 1; break;
+        case 'M': mcu = optarg; break;
+        case 'H': hpfShift = atoi(optarg); break;
+        case 'z': fuzzRounds = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); exit(1);
+        }
+    }
+    if(optind >= argc){
+        usage(argv[0]);
+        exit(1);
+    }
+    if(lookupSymbols(argv[optind]) < 0)
+        exit(1);
+    memset(&firmware, 0, sizeof(firmware));
+    if(elf_read_firmware(argv[optind], &firmware) != 0){
+        fprintf(stderr, "%s: cannot read firmware\n", argv[optind]);
+        exit(1);
+    }
+    if(firmware.mmcu[0] == 0)
+        snprintf(firmware.mmcu, sizeof(firmware.mmcu), "%s", mcu);
+    firmware.frequency = F_CPU;
+    if((avr = avr_make_mcu_by_name(firmware.mmcu)) == NULL){
+        fprintf(stderr, "simavr does not know %s\n", firmware.mmcu);
+        exit(1);
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_OUT_TRIGGER), adcTrigger, NULL);
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1), 1);   /* D- idle high */
+
+    runMs(400);     /* startup including the 300 ms USB disconnect */
+    if(vendorRequest(CLICMD_ECHO, 0x1234, reply, 2) != 2 || le(reply, 2) != 0x1234){
+        fprintf(stderr, "echo request failed\n");
+        exit(1);
+    }
+    if(fuzzRounds > 0){
+        srand(seed);
+        printf("fuzzing with seed %u\n", seed);
+        return fuzz(fuzzRounds);
+    }
+    for(i = 0; i < count; i++){
+        avr_cycle_count_t   start;
+
+        modelAccu = modelCnt = 0;
+        memset(modelHist, 0, sizeof(modelHist));
+        start = avr->cycle;
+        if(useMeasure){
+            if(vendorRequest(CLICMD_MEASURE, 0, reply, 6) != 6){
+                fprintf(stderr, "measure request failed\n");
+                exit(1);
+            }
+            accu = le(reply, 4);
+            cnt = le(reply + 4, 2);
+        }else{
+            vendorRequest(CLICMD_RUNADC, 0, reply, 0);
+            while(avr->data[sym.intervalRunning])
+                runMs(1);
+            if(vendorRequest(CLICMD_GETACC, 0, reply, 3) != 3)
+                exit(1);
+            accu = le(reply, 3);
+            if(vendorRequest(CLICMD_GETCNT, 0, reply, 2) != 2)
+                exit(1);
+            cnt = le(reply, 2);
+        }
+        printf("measurement %d: %s %.0f mV: samples %lu (fed %lu) accu %lu (model %lu) mean %.2f (model %.2f)",
+            i, waveform, amplitude, cnt, modelCnt, accu, modelAccu, cnt ? (double)accu / cnt : 0, modelCnt ? (double)modelAccu / modelCnt : 0);
+        if(modelCnt > 1)
+            printf(" cycles/sample %.1f", (double)(lastSampleCycle - firstSampleCycle) / (modelCnt - 1));
+        printf("\n");
+        if(verbose)
+            printf("  %.1f ms for the request sequence\n", (avr->cycle - start) * 1000.0 / F_CPU);
+        if(cnt != modelCnt || accu != modelAccu)
+            errors++;
+        errors += checkCapture();
+        errors += checkHistogram();
+    }
+    if(vendorRequest(CLICMD_GETPERF, 0, reply, 7) == 7)
+        printf("loop avg %.1f max %u ticks, late conversions %lu, usbPoll max %u, usbFunctionSetup max %u ticks\n",
+            le(reply, 2) / 256.0, reply[4], le(reply + 2, 2), reply[5], reply[6]);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}